@@ -4,6 +4,44 @@
 //
 
 #include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <charconv>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "poi_core.hpp" // The components which do not depend on Metaspex.
 
 #include "hx2a/root.hpp" // Points of interest are document roots.
 #include "hx2a/components/position.hpp" // For the position type offering latitude and longitude.
@@ -20,6 +58,16 @@
 #include "hx2a/payloads/query_id.hpp" // To receive a service payload giving a document identifier.
 #include "hx2a/payloads/reply_id.hpp" // To reply a document identifier when creating a point of interest.
 
+// Static probes (USDT) of the provider "poi", to trace production back-ends with eBPF or SystemTap. Each costs a nop
+// until traced. They need <sys/sdt.h> (systemtap-sdt-dev package); without it, or with POI_NO_USDT defined, they are
+// compiled out. Coordinates are passed in millionths, as integers.
+#if !defined(POI_NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define POI_PROBE(name, ...) STAP_PROBEV(poi, name, __VA_ARGS__)
+#else
+#define POI_PROBE(name, ...) ((void) 0)
+#endif
+
 /*
   The code below is a Metaspex specification. It is also code. It is a specification in the sense that it essentially describes
   the "what" and not the "how". It is code in the sense that it is not a set of diagrams, it is a piece of formal text which is 
@@ -38,8 +86,8 @@
     The mapping of logical database names below to physical databases is described in the configuration file. The object file produced 
     from the specification below is independent from physical databases and can be deployed on multiple databases.
   - No explicit commit or rollback is present.
-  - No network-related code is present. Yet, the code below produces HTTP REST JSON in/JSON out services, optionally supporting
-    TLS or SSL.
+  - No network-related code is present for the services. Yet, the code below produces HTTP REST JSON in/JSON out services,
+    optionally supporting TLS or SSL. The only sockets are those of the optional broadcast between back-ends, near the end.
   - No reference is made to Apache or Nginx, yet the code below is compiled as Apache or Nginx plug-ins.
   - No password is specified, the binary produced is independent from them. They are exclusively in the configuration file(s).
   - No data presentation is specified, no JSON, no BSON (MongoDB). This is automatic.
@@ -61,11 +109,93 @@ namespace poi {
   using poi_p = ptr<poi>;
   using poi_r = rfr<poi>;
 
+  // An opening period during a day of the week, in local time.
+  class opening: public element<>
+  {
+    HX2A_ELEMENT(opening, "opening", element,
+		 (day, open, close));
+  public:
+
+    slot<unsigned, "d"> day; // 0 is Monday, 6 is Sunday.
+    slot<unsigned, "o"> open; // Minutes since midnight.
+    slot<unsigned, "c"> close; // Minutes since midnight. Closing at or before opening means closing the day after.
+  };
+
+  // Weekly opening hours. We could reuse them for other types having opening hours (shops, offices...).
+  class opening_hours: public element<>
+  {
+    HX2A_ELEMENT(opening_hours, "opening_hours", element,
+		 (utc_offset, periods));
+  public:
+
+    // Minutes to add to UTC to obtain the local time. It is fixed: for a time zone with daylight saving time, the
+    // hours are off by the difference during half of the year (the poi must be updated twice a year).
+    slot<int, "tz"> utc_offset;
+    own_list<opening, "periods"> periods;
+
+    static constexpr unsigned day_minutes = 24 * 60;
+
+    static bool is_valid(const opening& o){
+      return o.day < 7 && o.open < day_minutes && o.close < day_minutes;
+    }
+  };
+
+  using opening_hours_p = ptr<opening_hours>;
+
+  // Opening hours compiled as a bitmap of the 15-minute slots of a week, in UTC. Testing whether a poi is open
+  // at a given time is one bit test.
+  class weekly_schedule
+  {
+  public:
+
+    static constexpr unsigned slot_minutes = 15;
+    static constexpr unsigned week_minutes = 7 * 24 * 60;
+    static constexpr unsigned slots = week_minutes / slot_minutes;
+
+    // Without opening hours, a poi is considered always open.
+    weekly_schedule(){
+      _slots.set();
+    }
+
+    // Periods out of range, which the creation service refuses, are ignored.
+    explicit weekly_schedule(const opening_hours& oh){
+      for (const rfr<opening>& o: oh.periods){
+	if (!opening_hours::is_valid(*o)){
+	  continue;
+	}
+
+	unsigned begin = o->day * 24 * 60 + o->open;
+	unsigned end = o->day * 24 * 60 + o->close;
+
+	if (end <= begin){
+	  end += 24 * 60;
+	}
+
+	// A slot is open if it starts within the period. Converting from local time to UTC.
+	for (unsigned m = (begin + slot_minutes - 1) / slot_minutes * slot_minutes; m < end; m += slot_minutes){
+	  int utc = (int(m) - oh.utc_offset) % int(week_minutes);
+	  _slots.set(unsigned(utc < 0 ? utc + week_minutes : utc) / slot_minutes);
+	}
+      }
+    }
+
+    bool is_open(size_t slot) const { return _slots.test(slot); }
+
+    // The Unix epoch is a Thursday, 3 days after a Monday.
+    static size_t slot_of(time_t t){
+      return size_t((t / 60 + 3 * 24 * 60) % week_minutes / slot_minutes);
+    }
+    
+  private:
+
+    std::bitset<slots> _slots;
+  };
+
   // We could add an address to a POI, taking the Foundation Ontology reusable address.
   class poi: public root<>
   {
     HX2A_ROOT(poi, "poi", 1, root,
-	      (name, pos, category));
+	      (name, pos, category, expiry, hours));
   public:
 
     // We could have derived types or more flexible, a separate category type a poi bears a strong link
@@ -79,11 +209,18 @@ namespace poi {
 		     restaurant = 3,
 		     shopping = 4
     };
+
+    static constexpr size_t categories = shopping + 1;
     
-    poi(string n, const position_r& p, category_t c):
+    // Permanent pois do not expire.
+    static constexpr time_t never = 0;
+
+    poi(string n, const position_r& p, category_t c, time_t x = never, const opening_hours_p& h = {}):
       name(*this, n),
       pos(*this, p), // own accepts position_r.
-      category(*this, c)
+      category(*this, c),
+      expiry(*this, x),
+      hours(*this, h)
     {
     }
 
@@ -91,11 +228,31 @@ namespace poi {
     static double get_longitude(const poi& p){ return p.pos->get_longitude(); }
     static category_t get_category(const poi& p){ return p.category; }
 
+    // The schedule is compiled by the first search filtering on opening hours which meets the poi. Concurrent
+    // searches wait for it, the following ones only test a bit.
+    bool is_open(size_t slot) const {
+      std::call_once(_schedule_compiled, [this]{
+	if (opening_hours_p oh = hours){
+	  _schedule = weekly_schedule(**oh);
+	}
+      });
+      return _schedule.is_open(slot);
+    }
+
     static constexpr tag_t index_by_last_save_timestamp = "poi_by_lst";
     
     slot<string, "name"> name;
     own<position, "pos"> pos; // The position type comes from Metaspex's Foundation Ontology.
     slot<category_t, "category"> category;
+    // Unix timestamp after which a temporary poi (pop-up event, mobile charger...) disappears.
+    slot<time_t, "expiry"> expiry;
+    own<opening_hours, "hours"> hours; // Optional, without them a poi is always open.
+
+  private:
+
+    // Not persistent, compiled from the opening hours.
+    mutable std::once_flag _schedule_compiled;
+    mutable weekly_schedule _schedule;
   };
 
   // Definition of the index type, using a Metaspex kdcache.
@@ -107,183 +264,3405 @@ namespace poi {
     slice_g<poi, poi::category_t, poi::get_category>
     >;
 
-  // Function to build the index from a database cursor. It assumes that an index capable of scanning 
-  // all points of interest exists (with the logical name "poi_per_lst" defined in the configuration file).
-  inline poi_index& get_poi_index(const db::connector& cn){
-    // Statics are thread-safe.
-    static poi_index c(
-		       "poi kdcache",                     // Name of the kdcache, just for tracing purposes.
-		       cn,
-		       poi::index_by_last_save_timestamp, // Name of the index by last save timestamp.
-		       128,                               // Number of documents acquired by the cursor at build or refresh.
-		       10                                 // Number of seconds before a new poi appears in the kdcache.
-		       );
-    return c;
-  }
+  // The kdcache of the original version of this sample is built, refreshed and searched, and that is all this file
+  // relies on by default. Defining POI_KDCACHE_EXTENSIONS assumes a kdcache which also offers:
+  //  - a constructor taking two more arguments, called back on each insertion and each removal,
+  //  - insert(const poi&) and remove(const poi&), to bring a poi in or take it out before the refresh does,
+  //  - search overloads taking a predicate on the poi, applied during the traversal,
+  //  - size(),
+  // and roots offering get_last_save_timestamp(). They must be checked against the reference guide of the Metaspex
+  // release in use. Expiry, as-of searches, subscriptions, delta synchronization, the purge, the peer broadcast and the
+  // detection of deletions need them, and are left out without the macro.
 
-  // Service paylods.
+  // Geometry. Rectangles are in poi_core.hpp, these give their intervals for kdcache searches.
 
-  // A reusable base class for poi payloads.
-  class poi_data_payload: public element<>
-  {
-    HX2A_ELEMENT(poi_data_payload, "poi_data_pld", element,
-		 (name, pos));
-  public:
+  inline interval<double> latitudes(const rectangle& r){ return {r.lm, r.lM}; }
+  inline interval<double> longitudes(const rectangle& r){ return {r.Lm, r.LM}; }
 
-    poi_data_payload(const poi_r& p):
-      name(*this, p->name),
-      pos(*this, p->pos->copy()) // The position is owned by the poi, we must copy it.
-    {
-    }
+  // Expiry of temporary pois.
 
-    slot<string, "name"> name;
-    own<position, "position"> pos;
-  };
+  // Identifiers of expired pois kept aside for the purge, at most. Every back-end expires every poi, so the purge calls
+  // reaching any of them remove the documents; the backlogs of the others are bounded by dropping the oldest ids.
+  // The documents of dropped ids are purged after a restart, which expires them again.
+  constexpr size_t purge_backlog_capacity = 1 << 16;
 
-  // Let's reuse and extend by adding the category.
-  class poi_create_payload: public poi_data_payload
+#ifdef POI_KDCACHE_EXTENSIONS
+  // Marks the removals from the kdcache made by the application itself (expiry, deletions by peers), for as long as it
+  // lives, so that the removal callback does not take them for detected deletions. The kdcache is assumed to call it
+  // back on the removing thread.
+  class explicit_removal
   {
-    HX2A_ELEMENT(poi_create_payload, "poi_create_pld", poi_data_payload,
-		 (category));
   public:
 
-    slot<poi::category_t, "category"> category;
+    explicit_removal(){ _active = true; }
+    ~explicit_removal(){ _active = false; }
+
+    static bool is_active(){ return _active; }
+
+  private:
+
+    static inline thread_local bool _active = false;
   };
- 
-  // We don't include the category, it is part of the search criteria, no need to return it.
-  class poi_search_data_payload: public poi_data_payload
+
+  // Owns the timing wheel of the index and the background thread ticking it. Expired pois are removed from the
+  // index and their identifiers are set aside, so that the documents can be purged in batches.
+  // The wheel is never cancelled: when a poi is updated or removed, its previous entry still fires, and is skipped if
+  // is_current tells that it is not the version in the index.
+  class poi_expiry
   {
-    HX2A_ELEMENT(poi_search_data_payload, "poi_search_data_pld", poi_data_payload,
-		 (id));
   public:
 
-    poi_search_data_payload(const poi_r& p):
-      poi_data_payload(p),
-      id(*this, p->get_id())
+    poi_expiry():
+      _wheel(time(nullptr))
     {
     }
+
+    void schedule(const poi_r& p){
+      if (p->expiry != poi::never){
+	std::lock_guard l(_mutex);
+	_wheel.schedule(p->expiry, p);
+      }
+    }
+
+    // Returns the thread ticking the wheel every second. It stops when the returned object is destroyed.
+    std::jthread ticker(poi_index& pi, std::function<bool(const poi_r&)> is_current){
+      return std::jthread([this, &pi, is_current = std::move(is_current)](std::stop_token st){
+	std::mutex m;
+	std::condition_variable_any cv;
+	std::unique_lock l(m);
+	
+	for (;;){
+	  cv.wait_for(l, st, std::chrono::seconds(1), []{ return false; });
+
+	  if (st.stop_requested()){
+	    return;
+	  }
+	  
+	  std::vector<poi_p> expired;
+
+	  {
+	    std::lock_guard wl(_mutex);
+	    _wheel.advance(time(nullptr), [&](const poi_p& p){ expired.push_back(p); });
+	  }
+
+	  std::erase_if(expired, [&](const poi_p& p){ return !is_current(*p); });
+
+	  // Removing outside of our lock, the index calls us back on removal.
+	  for (const poi_p& p: expired){
+	    explicit_removal er;
+	    pi.remove(*p);
+	  }
+
+	  std::lock_guard wl(_mutex);
+
+	  for (const poi_p& p: expired){
+	    if (_expired.size() == purge_backlog_capacity){
+	      _expired.pop_front();
+	    }
+	    
+	    _expired.push_back(p->get_id());
+	  }
+	}
+      });
+    }
+
+    // Hands over at most max identifiers of expired pois whose documents must be purged.
+    std::vector<doc_id> take_expired(size_t max){
+      std::lock_guard l(_mutex);
+      size_t n = std::min(max, _expired.size());
+      std::vector<doc_id> ids(_expired.end() - n, _expired.end());
+      _expired.resize(_expired.size() - n);
+      return ids;
+    }
     
-    slot<doc_id, "id"> id;
+  private:
+
+    std::mutex _mutex;
+    timing_wheel<poi_p> _wheel;
+    std::deque<doc_id> _expired;
   };
+#endif // POI_KDCACHE_EXTENSIONS
 
-  class pois_search_data_payload: public element<>
+  // History of the removed pois, for as-of searches.
+
+  // Where the history is appended. It must be writable by the Web server.
+  constexpr const char* history_path = "/var/tmp/poi_history.log";
+  // Number of seconds between two writes of the history.
+  constexpr unsigned history_flush_period = 1;
+  // Number of seconds a removed poi is kept in the history, in memory and on disk. As-of searches further in the past
+  // are refused.
+  constexpr time_t history_retention = 90 * 24 * 3600;
+  // Number of seconds between two rewrites of the history file without the records past retention.
+  constexpr time_t history_compaction_period = 3600;
+
+  // What remains of a poi once removed, with its validity interval.
+  struct removed_poi
+  {
+    doc_id id;
+    string name;
+    double latitude;
+    double longitude;
+    time_t saved; // Last save timestamp of the version.
+    time_t removed;
+  };
+
+  // A version of a poi still in the index is valid from its last save on. A removed version is kept here, valid from
+  // its last save to its removal, which is the last save of the next version if it was replaced. Together they give
+  // the pois as they were at any time since the history was started, within the retention. The history is appended to
+  // a local file so that it survives restarts. Records are called from the removal callback of the index, they are
+  // buffered and written by a background thread, which also drops the records past retention.
+#ifdef POI_KDCACHE_EXTENSIONS
+  class poi_history
   {
-    HX2A_ELEMENT(pois_search_data_payload, "pois_search_data_pld", element,
-		 (pois_data));
   public:
 
-    pois_search_data_payload():
-      pois_data(*this)
-    {
+    poi_history(){
+      std::ifstream f(history_path);
+      time_t oldest = time(nullptr) - history_retention;
+      string id;
+      int category;
+      removed_poi rp;
+
+      while (f >> id >> category >> rp.latitude >> rp.longitude >> rp.saved >> rp.removed && std::getline(f >> std::ws, rp.name)){
+	if (size_t(category) < poi::categories && rp.removed >= oldest){
+	  rp.id = doc_id(id);
+	  _removed[category].emplace(rp.latitude, rp);
+	}
+      }
+
+      _writer = std::jthread([this](std::stop_token st){ write(st); });
     }
 
-    void push_data(const rfr<poi_search_data_payload>& pd){
-      pois_data.push_back(pd);
+    void record(const poi_r& p, time_t removed){
+      if (size_t(p->category) >= poi::categories){
+	return;
+      }
+      
+      removed_poi rp{p->get_id(), p->name, poi::get_latitude(*p), poi::get_longitude(*p), p->get_last_save_timestamp(), removed};
+      string line = format(p->category, rp);
+      // Both locks, so that a compaction sees each record in memory and pending, or in neither.
+      std::unique_lock l(_mutex);
+      _removed[p->category].emplace(rp.latitude, rp);
+      std::lock_guard pl(_pending_mutex);
+      _pending += line;
+    }
+
+    // Calls f on at most limit removed pois of the area and category which were valid at the given time. Returns how
+    // many were found.
+    template <typename F>
+    size_t search(const interval<double>& li, const interval<double>& Li, poi::category_t category, time_t as_of, size_t limit, F&& f) const {
+      if (size_t(category) >= poi::categories){
+	return 0;
+      }
+      
+      std::shared_lock l(_mutex);
+      const auto& removed = _removed[category];
+      size_t found = 0;
+
+      for (auto i = removed.lower_bound(li.get_min()), e = removed.upper_bound(li.get_max()); i != e && found != limit; ++i){
+	const removed_poi& rp = i->second;
+
+	if (rp.longitude >= Li.get_min() && rp.longitude <= Li.get_max() && rp.saved <= as_of && as_of < rp.removed){
+	  f(rp);
+	  ++found;
+	}
+      }
+
+      return found;
     }
     
-    own_list<poi_search_data_payload, "pois"> pois_data;
+  private:
+
+    static string format(unsigned category, const removed_poi& rp){
+      char values[128];
+      snprintf(values, sizeof(values), " %u %.17g %.17g %lld %lld ", category, rp.latitude, rp.longitude, (long long) rp.saved, (long long) rp.removed);
+      return rp.id.to_string() + values + rp.name + '\n';
+    }
+    
+    // Appends the pending records to the file periodically, and a last time when stopping. Compacts the history at
+    // start, which drops what expired while stopped, and periodically.
+    void write(std::stop_token st){
+      std::ofstream log(history_path, std::ios::app);
+      std::mutex m;
+      std::condition_variable_any cv;
+      std::unique_lock l(m);
+      time_t last_compaction = 0;
+
+      for (bool stopping = false; !stopping;){
+	if (time(nullptr) - last_compaction >= history_compaction_period){
+	  compact(log);
+	  last_compaction = time(nullptr);
+	}
+	
+	cv.wait_for(l, st, std::chrono::seconds(history_flush_period), []{ return false; });
+	stopping = st.stop_requested();
+	string pending;
+
+	{
+	  std::lock_guard pl(_pending_mutex);
+	  pending.swap(_pending);
+	}
+
+	if (!pending.empty()){
+	  log << pending;
+	  log.flush();
+	}
+      }
+    }
+
+    // Drops the records past retention from memory, and rewrites the file from memory, which holds the pending
+    // records too. The file is written outside of the locks, not to hold up the removal callback of the index.
+    void compact(std::ofstream& log){
+      time_t oldest = time(nullptr) - history_retention;
+      string content;
+      string pending;
+
+      {
+	std::unique_lock l(_mutex);
+	std::lock_guard pl(_pending_mutex);
+
+	for (unsigned c = 0; c != poi::categories; ++c){
+	  std::erase_if(_removed[c], [&](const auto& e){ return e.second.removed < oldest; });
+
+	  for (const auto& [latitude, rp]: _removed[c]){
+	    content += format(c, rp);
+	  }
+	}
+
+	pending.swap(_pending);
+      }
+
+      string tmp = string(history_path) + ".tmp";
+      bool written = [&]{
+	std::ofstream f(tmp, std::ios::trunc);
+	f << content;
+	f.flush();
+	return bool(f);
+      }();
+
+      if (written && !rename(tmp.c_str(), history_path)){
+	log.close();
+	log.open(history_path, std::ios::app);
+      }
+      else {
+	// The records past retention stay in the current file, they are skipped when loading.
+	log << pending;
+	log.flush();
+      }
+    }
+
+    mutable std::shared_mutex _mutex;
+    // Per category, ordered by latitude.
+    std::array<std::multimap<double, removed_poi>, poi::categories> _removed;
+    // Taken after _mutex when both are.
+    std::mutex _pending_mutex;
+    string _pending;
+    // Last, so that it stops, writing what is pending, before the rest is destroyed.
+    std::jthread _writer;
   };
+#endif // POI_KDCACHE_EXTENSIONS
 
-  // This is the type expected to search for a point of interest.
-  // It contains the latitude and longitude rectangle and the category of poi.
-  // We reuse the area type from Metaspex's Foundation Ontology.
-  class area_and_category: public area
+  // Subscriptions to areas.
+
+  // Side of the square cells of the grid indexing subscriptions, in position units.
+  constexpr double subscription_cell_size = 256;
+  // A subscription covering more cells than this is checked against every event instead of being indexed.
+  constexpr size_t subscription_maximum_cells = 1024;
+  // Events kept for a subscription between two polls. Beyond, the subscriber must search the area again.
+  constexpr size_t subscription_maximum_events = 1024;
+  // A subscription which is not polled for this many seconds is dropped.
+  constexpr time_t subscription_timeout = 60;
+  // How long a poll waits for events, in seconds.
+  constexpr time_t subscription_poll_wait = 20;
+
+  // A poi entering or leaving an area.
+  struct poi_event
+  {
+    bool removed;
+    doc_id id;
+    string name;
+    double latitude;
+    double longitude;
+  };
+
+  // Clients subscribe to an area and a category, and are told about pois added to or removed from it, instead of
+  // polling searches. Events come from the index (build, refresh, detected deletion, expiry) and from the creations
+  // and deletions made by this back-end, so a poi can be notified twice. Events are idempotent per identifier.
+  // Subscriptions are indexed on a grid, so that an event is only matched against the subscriptions around it.
+#ifdef POI_KDCACHE_EXTENSIONS
+  class subscription_hub
   {
-    HX2A_ELEMENT(area_and_category, "area_and_category", area,
-		 (category));
   public:
 
-    area_and_category(
-		      latitude_t latitude_min,
-		      latitude_t latitude_max,
-		      longitude_t longitude_min,
-		      longitude_t longitude_max,
-		      poi::category_t category
-		  ):
-      area(latitude_min, latitude_max, longitude_min, longitude_max),
-      category(*this, category)
-    {
+    using subscription_id = uint64_t;
+
+    subscription_id subscribe(const interval<double>& li, const interval<double>& Li, poi::category_t category){
+      std::lock_guard l(_mutex);
+      drop_idle(time(nullptr));
+      subscription_id sid = ++_last_id;
+      subscription& s = _subscriptions.try_emplace(sid, rectangle(li, Li), category, time(nullptr)).first->second;
+      for_each_cell(s, [&](uint64_t cell){ _cells[cell].push_back(sid); }, [&]{ _wide.push_back(sid); });
+      return sid;
     }
-    
-    slot<poi::category_t, "category"> category;
-  };
 
-  // Application exceptions definitions.
+    void unsubscribe(subscription_id sid){
+      std::lock_guard l(_mutex);
+      erase(sid);
+    }
 
-  using position_is_missing = application_exception<"pmiss", "Position is missing.">;
-  
-  // Service definitions.
+    // Matches the event of a poi against the subscriptions around it. The removal of a version replaced by a successor
+    // is only published to the subscriptions which do not see the successor, as they were told about it already.
+    void publish(bool removed, const poi& p, const poi* successor = nullptr){
+      double latitude = poi::get_latitude(p);
+      double longitude = poi::get_longitude(p);
+      std::lock_guard l(_mutex);
 
-  // Creation of a POI.
-  auto _poi_create = service<"poi_create"> // Singleton. // The name of the service as it'll appear at the end of the URI accepted by the server.
-    ([](const rfr<poi_create_payload>& pcp) -> reply_id_p {
-      db::connector c{"hx2a"}; // Connector to the database described in the configuration file under the logical name "hx2a".
-      
-      // A poi constructor takes a non-null position, we must make sure the client did not forget to send one.
-      
-      // Throwing an exception will stop the service and send back a graceful error message to the client, with specifics about
-      // the issue.
-      position_r pcppos = pcp->pos.or_throw<position_is_missing>();
-      
-      // Creation of the poi. As we have a connector it'll persist in the "hx2a" database.
-      // We could write the two lines below as a single one. Using two for readability.
-      poi_r point = make<poi>(*c, pcp->name, pcppos->copy(), pcp->category);
-      
-      // Returning the document identifier of the newly-created poi to the client.
-      return make<reply_id>(point->get_id());
-      
-      // No commit, it's done automatically by Metaspex at the end of a successful service call (without exception thrown).
-    });
+      if (_subscriptions.empty()){
+	return;
+      }
 
-  // Deletion of a poi.
-  auto _poi_delete = service<"poi_delete">
-    ([](const rfr<query_id>& q){
-      db::connector c{"hx2a"};
+      bool notified = false;
+      auto notify = [&](subscription_id sid){
+	auto i = _subscriptions.find(sid);
 
-      // Retrieving the point of interest. It is a ptr and not a rfr because the document might not exist and get will return null.
-      poi_r point = poi::get(c, q->get_id()).or_throw<document_does_not_exist>();
-      
-      // This marks the document for removal, except if a rollback happens before the end of the service. A rollback is automatically
-      // triggered in case of exception. As we return right after, the document will be removed.
-      point->unpublish();
-    });
+	if (i == _subscriptions.end() || !i->second.matches(latitude, longitude, p.category)){
+	  return;
+	}
 
-  // Searching for a POI within an area and a given category.
-  auto _poi_search = service<"poi_search">
-    ([](const rfr<area_and_category>& query) -> ptr<pois_search_data_payload> {
-      db::connector c{"hx2a"};
-      // Grabbing the index. The first time it will build it.
-      poi_index& pi = get_poi_index(c);
-      // We want to display max 100 pois.
-      // We add one so that if we find 101, we return nothing so that the user has to zoom in.
-      constexpr size_t search_limit = 100 + 1;
-      // Preparing an array (could be another container such as std::vector or a std::deque) to store the search results.
-      std::array<poi_p, search_limit> a;
-      auto i = a.begin();
-      // Obtaining the intervals from the area payload.
-      // Putting them aside in case we reuse them for erasure.
-      interval<double> li = query->get_latitude_interval();
-      interval<double> Li = query->get_longitude_interval();
-      // The category interval is a singleton.
-      interval<poi::category_t> ti{query->category};
-      // Searching in the index.
-      auto e = pi.search(i, search_limit, li, Li, ti);
-      
-      // We count how many pois we found.
-      // If we got what we asked for (101 pois), we return nothing. This is different from returning an empty list.
-      // It means that the user must zoom in.
-      if (size_t(e - i) == search_limit){
-	return {}; // Please zoom in. Too much to display.
+	if (successor && i->second.matches(poi::get_latitude(*successor), poi::get_longitude(*successor), successor->category)){
+	  return;
+	}
+
+	subscription& s = i->second;
+
+	// Skipping it if already pending.
+	for (const poi_event& e: s.events){
+	  if (e.removed == removed && e.id == p.get_id()){
+	    return;
+	  }
+	}
+
+	if (s.events.size() == subscription_maximum_events){
+	  s.overflow = true;
+	  s.events.clear();
+	}
+
+	s.events.push_back(poi_event{removed, p.get_id(), p.name, latitude, longitude});
+	notified = true;
+      };
+
+      if (auto i = _cells.find(cell_of(latitude, longitude)); i != _cells.end()){
+	for (subscription_id sid: i->second){
+	  notify(sid);
+	}
+      }
+
+      for (subscription_id sid: _wide){
+	notify(sid);
+      }
+
+      if (notified){
+	_cv.notify_all();
+      }
+    }
+
+    // Waits for events, for a limited time. Returns false if the subscription does not exist (any more). Sets
+    // overflow if events were lost, the subscriber must then search the whole area again.
+    bool poll(subscription_id sid, std::vector<poi_event>& events, bool& overflow){
+      std::unique_lock l(_mutex);
+      auto has_events = [&]{
+	auto i = _subscriptions.find(sid);
+	return i == _subscriptions.end() || !i->second.events.empty() || i->second.overflow;
+      };
+
+      _cv.wait_for(l, std::chrono::seconds(subscription_poll_wait), has_events);
+      auto i = _subscriptions.find(sid);
+
+      if (i == _subscriptions.end()){
+	return false;
+      }
+
+      subscription& s = i->second;
+      events.assign(s.events.begin(), s.events.end());
+      s.events.clear();
+      overflow = s.overflow;
+      s.overflow = false;
+      s.last_poll = time(nullptr);
+      drop_idle(s.last_poll);
+      return true;
+    }
+    
+  private:
+
+    struct subscription
+    {
+      subscription(const rectangle& r, poi::category_t c, time_t t):
+	area(r),
+	category(c),
+	last_poll(t)
+      {
       }
       
-      // Now we can get the documents (if any).
-      // Building the empty reply.
-      rfr<pois_search_data_payload> pdp = make<pois_search_data_payload>();
+      bool matches(double latitude, double longitude, poi::category_t c) const {
+	return c == category && area.contains(latitude, longitude);
+      }
       
-      // Scanning all the search results.
-      while (i != e){
-	pdp->push_data(make<poi_search_data_payload>(**i));
-	++i;
+      rectangle area;
+      poi::category_t category;
+      time_t last_poll;
+      std::deque<poi_event> events;
+      bool overflow = false;
+    };
+
+    static int64_t cell_coordinate(double v){
+      return int64_t(std::floor(v / subscription_cell_size));
+    }
+
+    static uint64_t cell_of(int64_t lc, int64_t Lc){
+      return (uint64_t(uint32_t(lc)) << 32) | uint32_t(Lc);
+    }
+
+    static uint64_t cell_of(double latitude, double longitude){
+      return cell_of(cell_coordinate(latitude), cell_coordinate(longitude));
+    }
+
+    // Calls f on each cell covered by the subscription, or wide if there are too many of them.
+    template <typename F, typename W>
+    static void for_each_cell(const subscription& s, F&& f, W&& wide){
+      int64_t lcm = cell_coordinate(s.area.lm);
+      int64_t lcM = cell_coordinate(s.area.lM);
+      int64_t Lcm = cell_coordinate(s.area.Lm);
+      int64_t LcM = cell_coordinate(s.area.LM);
+
+      if (double(lcM - lcm + 1) * double(LcM - Lcm + 1) > subscription_maximum_cells){
+	wide();
+	return;
+      }
+
+      for (int64_t lc = lcm; lc <= lcM; ++lc){
+	for (int64_t Lc = Lcm; Lc <= LcM; ++Lc){
+	  f(cell_of(lc, Lc));
+	}
+      }
+    }
+
+    void erase(subscription_id sid){
+      auto i = _subscriptions.find(sid);
+
+      if (i == _subscriptions.end()){
+	return;
+      }
+
+      auto forget = [sid](std::vector<subscription_id>& sids){ std::erase(sids, sid); };
+      for_each_cell(i->second,
+		    [&](uint64_t cell){
+		      auto c = _cells.find(cell);
+		      forget(c->second);
+
+		      if (c->second.empty()){
+			_cells.erase(c);
+		      }
+		    },
+		    [&]{ forget(_wide); });
+      _subscriptions.erase(i);
+      // Waking up a poll on it, if any.
+      _cv.notify_all();
+    }
+
+    void drop_idle(time_t now){
+      std::vector<subscription_id> idle;
+
+      for (const auto& [sid, s]: _subscriptions){
+	if (now - s.last_poll > subscription_timeout){
+	  idle.push_back(sid);
+	}
+      }
+
+      for (subscription_id sid: idle){
+	erase(sid);
+      }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    subscription_id _last_id = 0;
+    std::unordered_map<subscription_id, subscription> _subscriptions;
+    std::unordered_map<uint64_t, std::vector<subscription_id>> _cells;
+    std::vector<subscription_id> _wide;
+  };
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Change log, for delta synchronization.
+
+  // Changes kept in memory. Clients which are further behind receive a full snapshot of their area.
+  constexpr size_t change_log_capacity = 1 << 16;
+
+  // Where the new version of a replaced poi is.
+  struct poi_location
+  {
+    double latitude;
+    double longitude;
+    poi::category_t category;
+  };
+
+  struct poi_change
+  {
+    uint64_t generation;
+    poi::category_t category;
+    poi_event event;
+    // For the removal of a replaced version. Clients seeing the new version received it already, they must keep it.
+    std::optional<poi_location> successor;
+  };
+
+  // Bounded log of the changes made to the index, numbered by generation. Offline-capable clients keep the generation
+  // of their last synchronization and ask for the changes made since. The build of the index is not logged: a client
+  // missing it, or whose generation was truncated out of the log, needs a snapshot. Generations start at a value
+  // derived from the start time and a random number, so that the generations of another back-end, or of a previous
+  // run, are not mistaken for ours.
+#ifdef POI_KDCACHE_EXTENSIONS
+  class change_log
+  {
+  public:
+
+    change_log():
+      _generation((uint64_t(time(nullptr)) << 32) | (uint64_t(std::random_device{}() & 0xff) << 24))
+    {
+    }
+
+    // Called once the index is built. Changes are logged from then on.
+    void start(){
+      std::unique_lock l(_mutex);
+      _started = true;
+    }
+
+    void record(bool removed, const poi& p, const poi* successor = nullptr){
+      std::optional<poi_location> sl;
+
+      if (successor){
+	sl = poi_location{poi::get_latitude(*successor), poi::get_longitude(*successor), successor->category};
+      }
+      
+      std::unique_lock l(_mutex);
+
+      if (!_started){
+	return;
+      }
+
+      if (_changes.size() == change_log_capacity){
+	_changes.pop_front();
+      }
+
+      _changes.push_back(poi_change{++_generation, p.category, poi_event{removed, p.get_id(), p.name, poi::get_latitude(p), poi::get_longitude(p)}, sl});
+    }
+
+    uint64_t get_generation() const {
+      std::shared_lock l(_mutex);
+      return _generation;
+    }
+
+    // Calls f on each change of the area and category made after the given generation. Returns false if some of them
+    // are not in the log any more. Sets generation to the last one.
+    template <typename F>
+    bool since(uint64_t& generation, const rectangle& area, poi::category_t category, F&& f) const {
+      std::shared_lock l(_mutex);
+      uint64_t first = _generation - _changes.size();
+
+      if (generation < first || generation > _generation){
+	generation = _generation;
+	return false;
+      }
+
+      // Generations are consecutive in the log.
+      for (auto i = _changes.begin() + (generation - first); i != _changes.end(); ++i){
+	if (i->category == category && area.contains(i->event.latitude, i->event.longitude) &&
+	    !(i->successor && i->successor->category == category && area.contains(i->successor->latitude, i->successor->longitude))){
+	  f(i->event);
+	}
+      }
+
+      generation = _generation;
+      return true;
+    }
+    
+  private:
+
+    mutable std::shared_mutex _mutex;
+    bool _started = false;
+    uint64_t _generation;
+    std::deque<poi_change> _changes;
+  };
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // The entries of the kdcache by id, so that a poi can be found, removed or checked for being the current version
+  // without searching for it. Maintained by the observer as the kdcache inserts, updates and removes pois.
+#ifdef POI_KDCACHE_EXTENSIONS
+  class poi_entries
+  {
+  public:
+
+    void insert(const poi_r& p){
+      std::unique_lock l(_mutex);
+      _entries.insert_or_assign(poi_id(p->get_id().to_string()), p);
+    }
+
+    // Only if it was not replaced by a newer version of the poi in the meantime. Returns whether it was erased.
+    bool erase(const poi_r& p){
+      poi_id id(p->get_id().to_string());
+      std::unique_lock l(_mutex);
+
+      if (const poi_p* e = _entries.find(id); e && &***e == &*p){
+	_entries.erase(id);
+	return true;
+      }
+
+      return false;
+    }
+
+    poi_p find(const poi_id& id) const {
+      std::shared_lock l(_mutex);
+      const poi_p* p = _entries.find(id);
+      return p ? *p : poi_p{};
+    }
+
+    // Whether it is the version of the poi in the kdcache.
+    bool is_current(const poi_r& p) const {
+      std::shared_lock l(_mutex);
+      const poi_p* e = _entries.find(poi_id(p->get_id().to_string()));
+      return e && &***e == &*p;
+    }
+    
+  private:
+
+    mutable std::shared_mutex _mutex;
+    id_map<poi_p> _entries;
+  };
+
+  // Keeps the structures living alongside the index up to date. The kdcache calls it back on each insertion
+  // (build, refresh or explicit insertion) and on each removal (detected deletion or explicit removal).
+  class poi_index_observer
+  {
+  public:
+
+    void inserted(const poi_r& p){
+      entries.insert(p);
+      expiry.schedule(p);
+      subscriptions.publish(false, *p);
+      changes.record(false, *p);
+    }
+
+    void removed(const poi_r& p){
+      // A replaced version: the new one was inserted, published and logged before. As the poi might have moved or
+      // changed category, the subscribers and clients which do not see the new version are told that the old one left.
+      if (!entries.erase(p)){
+	poi_p successor = entries.find(poi_id(p->get_id().to_string()));
+
+	if (successor){
+	  subscriptions.publish(true, *p, &**successor);
+	  changes.record(true, *p, &**successor);
+	}
+
+	// The old version is valid until the new one was saved.
+	history.record(p, successor ? (*successor)->get_last_save_timestamp() : time(nullptr));
+	return;
+      }
+      
+      // The removals made by the application are not deletions found by the kdcache.
+      if (!explicit_removal::is_active()){
+	POI_PROBE(deletion__detected, "kdcache", poi_id(p->get_id().to_string()).high, poi_id(p->get_id().to_string()).low);
+      }
+
+      history.record(p, time(nullptr));
+      subscriptions.publish(true, *p);
+      changes.record(true, *p);
+    }
+
+    poi_entries entries;
+    poi_expiry expiry;
+    poi_history history;
+    subscription_hub subscriptions;
+    change_log changes;
+  };
+
+  inline poi_index_observer& get_poi_index_observer(){
+    static poi_index_observer o;
+    return o;
+  }
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Defined below, once the search path is available.
+  inline void warm_up(poi_index& pi);
+
+#ifdef POI_KDCACHE_EXTENSIONS
+  // Defined below, with the transports.
+  class peer_broadcaster;
+  inline peer_broadcaster* get_peer_broadcaster();
+#endif
+
+  // Set once the kdcache is built, for the components which must not trigger its build.
+  inline std::atomic<poi_index*> built_poi_index = nullptr;
+
+  // Function to build the index from a database cursor. It assumes that an index capable of scanning 
+  // all points of interest exists (with the logical name "poi_per_lst" defined in the configuration file).
+  // With POI_KDCACHE_EXTENSIONS (see above), the constructor takes two more arguments than the one used originally
+  // (name, connector, index, batch size, delay), called on each insertion and removal. Expiry, history, subscriptions,
+  // the change log and the entries by id rely on them.
+  inline poi_index& get_poi_index(const db::connector& cn){
+    // Statics are thread-safe.
+    static poi_index c(
+		       "poi kdcache",                     // Name of the kdcache, just for tracing purposes.
+		       cn,
+		       poi::index_by_last_save_timestamp, // Name of the index by last save timestamp.
+		       128,                               // Number of documents acquired by the cursor at build or refresh.
+		       10                                 // Number of seconds before a new poi appears in the kdcache.
+#ifdef POI_KDCACHE_EXTENSIONS
+		       ,
+		       [](const poi_r& p){ get_poi_index_observer().inserted(p); },
+		       [](const poi_r& p){ get_poi_index_observer().removed(p); }
+#endif
+		       );
+#ifdef POI_KDCACHE_EXTENSIONS
+    // Expired pois leave the index from now on. Declared after the index so that it stops before the index is destroyed.
+    static std::jthread expiry_ticker = get_poi_index_observer().expiry.ticker(c, [](const poi_r& p){
+      return get_poi_index_observer().entries.is_current(p);
+    });
+    // Subsequent changes are logged for delta synchronization.
+    static const bool logging = (get_poi_index_observer().changes.start(), true);
+    (void) logging;
+#endif
+    // Replaying recently recorded searches before the first one is served. Concurrent callers wait for the
+    // initialization of the static below, so the back-end only starts answering once the index is warm.
+    static const bool warm = (warm_up(c), true);
+    (void) warm;
+    built_poi_index = &c;
+#ifdef POI_KDCACHE_EXTENSIONS
+    // Applying the events of the peers from now on, and not from the first creation or deletion made here. A transport
+    // which cannot be set up is reported by creations and deletions, searches go on without it.
+    static const bool receiving = []{
+      try {
+	get_peer_broadcaster();
+      }
+      catch (const std::system_error&){
+      }
+      
+      return true;
+    }();
+    (void) receiving;
+#endif
+    return c;
+  }
+
+  // Service paylods.
+
+  // A reusable base class for poi payloads.
+  class poi_data_payload: public element<>
+  {
+    HX2A_ELEMENT(poi_data_payload, "poi_data_pld", element,
+		 (name, pos));
+  public:
+
+    poi_data_payload(const poi_r& p):
+      name(*this, p->name),
+      pos(*this, p->pos->copy()) // The position is owned by the poi, we must copy it.
+    {
+    }
+
+    // For pois which are not in the database any more.
+    poi_data_payload(const string& n, const position_r& p):
+      name(*this, n),
+      pos(*this, p)
+    {
+    }
+
+    slot<string, "name"> name;
+    own<position, "position"> pos;
+  };
+
+  // Let's reuse and extend by adding the category.
+  class poi_create_payload: public poi_data_payload
+  {
+    HX2A_ELEMENT(poi_create_payload, "poi_create_pld", poi_data_payload,
+		 (category, expiry, hours));
+  public:
+
+    slot<poi::category_t, "category"> category;
+    // Optional, the poi is permanent if it is not given.
+    slot<time_t, "expiry"> expiry;
+    // Optional, the poi is always open if they are not given.
+    own<opening_hours, "hours"> hours;
+  };
+ 
+  // We don't include the category, it is part of the search criteria, no need to return it.
+  class poi_search_data_payload: public poi_data_payload
+  {
+    HX2A_ELEMENT(poi_search_data_payload, "poi_search_data_pld", poi_data_payload,
+		 (id));
+  public:
+
+    poi_search_data_payload(const poi_r& p):
+      poi_data_payload(p),
+      id(*this, p->get_id())
+    {
+    }
+
+    // For pois which might not be in the database any more.
+    poi_search_data_payload(const doc_id& i, const string& n, const position_r& p):
+      poi_data_payload(n, p),
+      id(*this, i)
+    {
+    }
+
+    poi_search_data_payload(const removed_poi& rp):
+      poi_search_data_payload(rp.id, rp.name, make<position>(rp.latitude, rp.longitude))
+    {
+    }
+    
+    slot<doc_id, "id"> id;
+  };
+
+  // Accumulated measures of a phase of a service.
+  class phase_stats_payload: public element<>
+  {
+    HX2A_ELEMENT(phase_stats_payload, "phase_stats_pld", element,
+		 (phase, calls, real, cpu));
+  public:
+
+    phase_stats_payload(const string& p, uint64_t n, uint64_t r, uint64_t c):
+      phase(*this, p),
+      calls(*this, n),
+      real(*this, r),
+      cpu(*this, c)
+    {
+    }
+
+    slot<string, "phase"> phase;
+    slot<uint64_t, "calls"> calls;
+    slot<uint64_t, "real"> real; // Nanoseconds.
+    slot<uint64_t, "cpu"> cpu; // Nanoseconds.
+  };
+
+  // The phases of a single search call, and their sum: the time spent in the body of the service, which does not
+  // include query parsing and reply serialization.
+  class search_timing_payload: public element<>
+  {
+    HX2A_ELEMENT(search_timing_payload, "search_timing_pld", element,
+		 (phases, real, cpu));
+  public:
+
+    search_timing_payload():
+      phases(*this),
+      real(*this, 0),
+      cpu(*this, 0)
+    {
+    }
+
+    void push_phase(const rfr<phase_stats_payload>& p){
+      phases.push_back(p);
+      real = real + p->real;
+      cpu = cpu + p->cpu;
+    }
+
+    own_list<phase_stats_payload, "phases"> phases;
+    slot<uint64_t, "real"> real; // Nanoseconds.
+    slot<uint64_t, "cpu"> cpu; // Nanoseconds.
+  };
+
+  class pois_search_data_payload: public element<>
+  {
+    HX2A_ELEMENT(pois_search_data_payload, "pois_search_data_pld", element,
+		 (pois_data, timing));
+  public:
+
+    pois_search_data_payload():
+      pois_data(*this),
+      timing(*this)
+    {
+    }
+
+    void push_data(const rfr<poi_search_data_payload>& pd){
+      pois_data.push_back(pd);
+    }
+
+    void set_timing(const rfr<search_timing_payload>& t){
+      timing = t;
+    }
+    
+    own_list<poi_search_data_payload, "pois"> pois_data;
+    own<search_timing_payload, "timing"> timing; // Only if asked for.
+  };
+
+  // The nearest poi of a category, with its distance to the position searched.
+  class poi_nearest_data_payload: public poi_search_data_payload
+  {
+    HX2A_ELEMENT(poi_nearest_data_payload, "poi_nearest_data_pld", poi_search_data_payload,
+		 (category, distance));
+  public:
+
+    poi_nearest_data_payload(const poi_r& p, double d):
+      poi_search_data_payload(p),
+      category(*this, p->category),
+      distance(*this, d)
+    {
+    }
+
+    slot<poi::category_t, "category"> category;
+    slot<double, "distance"> distance;
+  };
+
+  class pois_nearest_data_payload: public element<>
+  {
+    HX2A_ELEMENT(pois_nearest_data_payload, "pois_nearest_data_pld", element,
+		 (pois_data));
+  public:
+
+    pois_nearest_data_payload():
+      pois_data(*this)
+    {
+    }
+
+    void push_data(const rfr<poi_nearest_data_payload>& pd){
+      pois_data.push_back(pd);
+    }
+    
+    own_list<poi_nearest_data_payload, "pois"> pois_data;
+  };
+
+  // A position and the categories of the pois we want the nearest of.
+  class position_and_categories: public element<>
+  {
+    HX2A_ELEMENT(position_and_categories, "position_and_categories", element,
+		 (pos, categories));
+  public:
+
+    own<position, "position"> pos;
+    // All categories if empty.
+    slot<std::vector<poi::category_t>, "categories"> categories;
+  };
+
+  // Positions to assign the nearest poi of a category to.
+  class positions_and_category: public element<>
+  {
+    HX2A_ELEMENT(positions_and_category, "positions_and_category", element,
+		 (positions, category));
+  public:
+
+    own_list<position, "positions"> positions;
+    slot<poi::category_t, "category"> category;
+  };
+
+  // The poi assigned to the position of a given rank in the query.
+  class poi_assignment_payload: public element<>
+  {
+    HX2A_ELEMENT(poi_assignment_payload, "poi_assignment_pld", element,
+		 (rank, id, distance));
+  public:
+
+    poi_assignment_payload(size_t r, const doc_id& i, double d):
+      rank(*this, r),
+      id(*this, i),
+      distance(*this, d)
+    {
+    }
+
+    slot<size_t, "i"> rank;
+    slot<doc_id, "id"> id;
+    slot<double, "distance"> distance;
+  };
+
+  class poi_assignments_payload: public element<>
+  {
+    HX2A_ELEMENT(poi_assignments_payload, "poi_assignments_pld", element,
+		 (assignments));
+  public:
+
+    poi_assignments_payload():
+      assignments(*this)
+    {
+    }
+
+    void push_data(const rfr<poi_assignment_payload>& pa){
+      assignments.push_back(pa);
+    }
+    
+    own_list<poi_assignment_payload, "assignments"> assignments;
+  };
+
+  // Names a file of the assignment directory.
+  class file_name: public element<>
+  {
+    HX2A_ELEMENT(file_name, "file_name", element,
+		 (name));
+  public:
+
+    slot<string, "name"> name;
+  };
+
+  // The input file of an assignment job, and the category assigned.
+  class assignment_file: public file_name
+  {
+    HX2A_ELEMENT(assignment_file, "assignment_file", file_name,
+		 (category));
+  public:
+
+    slot<poi::category_t, "category"> category;
+  };
+
+  // Where an assignment job is. The number of positions is 0 until the input file is read.
+  class assignment_status_payload: public element<>
+  {
+    HX2A_ELEMENT(assignment_status_payload, "assignment_status_pld", element,
+		 (state, processed, positions, error));
+  public:
+
+    assignment_status_payload(const string& s, size_t pr, size_t po, const string& e):
+      state(*this, s),
+      processed(*this, pr),
+      positions(*this, po),
+      error(*this, e)
+    {
+    }
+
+    slot<string, "state"> state; // "running", "done" or "failed".
+    slot<size_t, "processed"> processed;
+    slot<size_t, "positions"> positions;
+    slot<string, "error"> error; // Empty unless failed.
+  };
+
+  // An event of a subscription.
+  class poi_event_payload: public poi_search_data_payload
+  {
+    HX2A_ELEMENT(poi_event_payload, "poi_event_pld", poi_search_data_payload,
+		 (removed));
+  public:
+
+    poi_event_payload(const poi_event& e):
+      poi_search_data_payload(e.id, e.name, make<position>(e.latitude, e.longitude)),
+      removed(*this, e.removed)
+    {
+    }
+
+    slot<bool, "removed"> removed;
+  };
+
+  class poi_events_payload: public element<>
+  {
+    HX2A_ELEMENT(poi_events_payload, "poi_events_pld", element,
+		 (events, resync));
+  public:
+
+    poi_events_payload(bool r):
+      events(*this),
+      resync(*this, r)
+    {
+    }
+
+    void push_data(const rfr<poi_event_payload>& pe){
+      events.push_back(pe);
+    }
+    
+    own_list<poi_event_payload, "events"> events;
+    // Events were lost, the area must be searched again.
+    slot<bool, "resync"> resync;
+  };
+
+  // Identifies a subscription, in queries and replies.
+#ifdef POI_KDCACHE_EXTENSIONS
+  class subscription_payload: public element<>
+  {
+    HX2A_ELEMENT(subscription_payload, "subscription_pld", element,
+		 (subscription));
+  public:
+
+    subscription_payload(subscription_hub::subscription_id sid):
+      subscription(*this, sid)
+    {
+    }
+
+    slot<subscription_hub::subscription_id, "subscription"> subscription;
+  };
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // What changed in the pois displayed when moving from an area to another one.
+  class viewport_diff_payload: public element<>
+  {
+    HX2A_ELEMENT(viewport_diff_payload, "viewport_diff_pld", element,
+		 (entering, leaving));
+  public:
+
+    viewport_diff_payload():
+      entering(*this),
+      leaving(*this, std::vector<doc_id>{})
+    {
+    }
+
+    void push_entering(const rfr<poi_search_data_payload>& pd){
+      entering.push_back(pd);
+    }
+    
+    own_list<poi_search_data_payload, "entering"> entering;
+    // The client already has their data, only the identifiers are sent.
+    slot<std::vector<doc_id>, "leaving"> leaving;
+  };
+
+  // The changes since a generation, or a full snapshot of the area.
+  class poi_sync_payload: public element<>
+  {
+    HX2A_ELEMENT(poi_sync_payload, "poi_sync_pld", element,
+		 (generation, full, changes));
+  public:
+
+    poi_sync_payload(uint64_t g, bool f):
+      generation(*this, g),
+      full(*this, f),
+      changes(*this)
+    {
+    }
+
+    void push_data(const rfr<poi_event_payload>& pe){
+      changes.push_back(pe);
+    }
+    
+    // To be sent back at the next synchronization.
+    slot<uint64_t, "generation"> generation;
+    // If true, the changes are a full snapshot of the area (all of them added), the client must drop what it has.
+    slot<bool, "full"> full;
+    own_list<poi_event_payload, "changes"> changes;
+  };
+
+  // Names the package to build, and its region.
+  class package_query: public area
+  {
+    HX2A_ELEMENT(package_query, "package_query", area,
+		 (name));
+  public:
+
+    slot<string, "name"> name;
+  };
+
+  // The package built.
+  class package_payload: public element<>
+  {
+    HX2A_ELEMENT(package_payload, "package_pld", element,
+		 (count, size));
+  public:
+
+    package_payload(size_t c, uint64_t s):
+      count(*this, c),
+      size(*this, s)
+    {
+    }
+
+    slot<size_t, "count"> count; // Number of pois.
+    slot<uint64_t, "size"> size; // In bytes.
+  };
+
+  // This is the type expected to search for a point of interest.
+  // It contains the latitude and longitude rectangle and the category of poi.
+  // We reuse the area type from Metaspex's Foundation Ontology.
+  class area_and_category: public area
+  {
+    HX2A_ELEMENT(area_and_category, "area_and_category", area,
+		 (category, open_now, open_at, as_of, timing));
+  public:
+
+    area_and_category(
+		      latitude_t latitude_min,
+		      latitude_t latitude_max,
+		      longitude_t longitude_min,
+		      longitude_t longitude_max,
+		      poi::category_t category
+		  ):
+      area(latitude_min, latitude_max, longitude_min, longitude_max),
+      category(*this, category),
+      open_now(*this, false),
+      open_at(*this, 0),
+      as_of(*this, 0),
+      timing(*this, false)
+    {
+    }
+
+    // Returns the time at which the pois must be open, or 0 if the search does not filter on opening hours.
+    time_t get_open_time() const {
+      return open_now ? time(nullptr) : open_at;
+    }
+    
+    slot<poi::category_t, "category"> category;
+    // Optional filters on opening hours.
+    slot<bool, "open_now"> open_now;
+    slot<time_t, "open_at"> open_at; // Unix timestamp.
+    // Optional Unix timestamp, to obtain the pois as they were at that time.
+    slot<time_t, "as_of"> as_of;
+    // Optional, to obtain the phases of the search call in the reply.
+    slot<bool, "timing"> timing;
+  };
+
+  // An area to synchronize, with the generation of the last synchronization (0 the first time).
+  class sync_query: public area_and_category
+  {
+    HX2A_ELEMENT(sync_query, "sync_query", area_and_category,
+		 (since));
+  public:
+
+    slot<uint64_t, "since"> since;
+  };
+
+  // The new area, and the previous one. Both in the same category.
+  class viewport_change: public area_and_category
+  {
+    HX2A_ELEMENT(viewport_change, "viewport_change", area_and_category,
+		 (previous));
+  public:
+
+    own<area, "previous"> previous;
+  };
+
+  // Application exceptions definitions.
+
+  using position_is_missing = application_exception<"pmiss", "Position is missing.">;
+  using invalid_file_name = application_exception<"ifname", "Invalid file name.">;
+  using cannot_read_file = application_exception<"rfile", "Cannot read file.">;
+  using cannot_write_file = application_exception<"wfile", "Cannot write file.">;
+  using unknown_subscription = application_exception<"usub", "Unknown subscription.">;
+  using previous_area_is_missing = application_exception<"amiss", "Previous area is missing.">;
+  using as_of_before_history = application_exception<"ahist", "As-of time is before the retained history.">;
+  using invalid_opening_hours = application_exception<"ihours", "Invalid opening hours.">;
+  using not_supported = application_exception<"nsup", "Not supported by this back-end.">;
+  using job_is_running = application_exception<"jrun", "An assignment job is already running on this file.">;
+  using unknown_job = application_exception<"ujob", "Unknown assignment job.">;
+
+  // Reply of the purge of expired pois.
+  class purge_payload: public element<>
+  {
+    HX2A_ELEMENT(purge_payload, "purge_pld", element,
+		 (purged));
+  public:
+
+    purge_payload(size_t p):
+      purged(*this, p)
+    {
+    }
+
+    slot<size_t, "purged"> purged;
+  };
+
+  // A histogram of durations. Bucket i counts the durations of less than 2^i nanoseconds, and at least 2^(i - 1).
+  class histogram_payload: public element<>
+  {
+    HX2A_ELEMENT(histogram_payload, "histogram_pld", element,
+		 (name, count, sum, buckets));
+  public:
+
+    histogram_payload(const string& n, uint64_t c, uint64_t s, const std::vector<uint64_t>& b):
+      name(*this, n),
+      count(*this, c),
+      sum(*this, s),
+      buckets(*this, b)
+    {
+    }
+
+    slot<string, "name"> name;
+    slot<uint64_t, "count"> count;
+    slot<uint64_t, "sum"> sum; // Nanoseconds.
+    slot<std::vector<uint64_t>, "buckets"> buckets;
+  };
+
+  // Statistics of the indices.
+  class index_stats_payload: public element<>
+  {
+    HX2A_ELEMENT(index_stats_payload, "index_stats_pld", element,
+		 (pois, search_phases, kdcache, dropped_spans));
+  public:
+
+    index_stats_payload(size_t p, uint64_t d):
+      pois(*this, p),
+      search_phases(*this),
+      kdcache(*this),
+      dropped_spans(*this, d)
+    {
+    }
+
+    void push_search_phase(const rfr<phase_stats_payload>& ps){
+      search_phases.push_back(ps);
+    }
+
+    void push_kdcache(const rfr<histogram_payload>& h){
+      kdcache.push_back(h);
+    }
+
+    slot<size_t, "pois"> pois; // In the kdcache.
+    own_list<phase_stats_payload, "search_phases"> search_phases;
+    // Durations of the kdcache operations, timed from outside, and the estimate of their lock waits.
+    own_list<histogram_payload, "kdcache"> kdcache;
+    // Spans the exporter could not keep up with, since the start of the back-end.
+    slot<uint64_t, "dropped_spans"> dropped_spans;
+  };
+
+  // Result of counts.
+  class count_payload: public element<>
+  {
+    HX2A_ELEMENT(count_payload, "count_pld", element,
+		 (count));
+  public:
+
+    count_payload(size_t c):
+      count(*this, c)
+    {
+    }
+
+    slot<size_t, "count"> count;
+  };
+
+  // Maximum number of expired documents removed by a single purge call.
+  constexpr size_t purge_batch_size = 64;
+  
+  // Kdcache metrics.
+
+  // Histogram of durations. Bucket i counts the durations of less than 2^i nanoseconds, and at least 2^(i - 1).
+  class duration_histogram
+  {
+  public:
+
+    static constexpr size_t buckets = 40; // The last one counts everything above 9 minutes.
+    
+    void record(uint64_t nanoseconds){
+      ++_buckets[std::min(size_t(std::bit_width(nanoseconds)), buckets - 1)];
+      ++_count;
+      _sum += nanoseconds;
+    }
+
+    uint64_t get_count() const { return _count; }
+    uint64_t get_sum() const { return _sum; }
+
+    std::vector<uint64_t> get_buckets() const {
+      std::vector<uint64_t> b(buckets);
+
+      for (size_t i = 0; i != buckets; ++i){
+	b[i] = _buckets[i];
+      }
+
+      return b;
+    }
+    
+  private:
+
+    std::atomic<uint64_t> _buckets[buckets] = {};
+    std::atomic<uint64_t> _count = 0;
+    std::atomic<uint64_t> _sum = 0;
+  };
+
+  inline uint64_t steady_nanoseconds(){
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  inline uint64_t thread_cpu_nanoseconds(){
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return uint64_t(t.tv_sec) * 1000000000 + uint64_t(t.tv_nsec);
+  }
+  
+  // The kdcache locks internally, out of reach: its wait and hold times, and the searches blocked by a refresh, cannot
+  // be measured. Its operations are timed from outside instead. As the documents are in memory, the time searches
+  // spend off CPU is mostly spent waiting for its lock, held by refreshes. It is only an estimate of the lock wait:
+  // preemption and page faults count too.
+  struct kdcache_metrics
+  {
+    duration_histogram search;
+    duration_histogram search_off_cpu; // Estimate of the lock wait.
+    duration_histogram remove;
+  };
+
+  inline kdcache_metrics& get_kdcache_metrics(){
+    static kdcache_metrics km;
+    return km;
+  }
+
+  // Times a kdcache operation from its construction to its destruction, and optionally its time off CPU.
+  class kdcache_timer
+  {
+  public:
+
+    kdcache_timer(duration_histogram& real, duration_histogram* off_cpu = nullptr):
+      _real(real),
+      _off_cpu(off_cpu),
+      _start(steady_nanoseconds()),
+      _cpu_start(off_cpu ? thread_cpu_nanoseconds() : 0)
+    {
+    }
+
+    ~kdcache_timer(){
+      uint64_t real = steady_nanoseconds() - _start;
+      _real.record(real);
+
+      if (_off_cpu){
+	uint64_t cpu = thread_cpu_nanoseconds() - _cpu_start;
+	_off_cpu->record(real > cpu ? real - cpu : 0);
+      }
+    }
+
+  private:
+
+    duration_histogram& _real;
+    duration_histogram* _off_cpu;
+    uint64_t _start;
+    uint64_t _cpu_start;
+  };
+  
+  // Tracing.
+
+  // Spans of service calls and of their main steps, in the OpenTelemetry model, exported in OTLP/JSON: one export
+  // request per line of a local file, which an OpenTelemetry collector can ingest (otlpjsonfile receiver). A sampled
+  // share of the service calls is traced, with all their steps. Ended spans are queued in memory, a background thread
+  // writes them in batches, so that the request path never does any I/O. When the queue is full spans are dropped.
+
+  // Share of the service calls traced, between 0 and 1.
+  constexpr double tracing_sample_rate = 0.01;
+  // Where spans are written. It must be writable by the Web server.
+  constexpr const char* tracing_path = "/var/tmp/poi_traces.json";
+  // Number of spans written together, at most.
+  constexpr size_t tracing_batch_size = 512;
+  // Maximum number of spans waiting to be written.
+  constexpr size_t tracing_queue_capacity = 8192;
+  // Number of seconds between two writes, at most.
+  constexpr unsigned tracing_flush_period = 5;
+
+  // An ended span.
+  struct span_record
+  {
+    // Span kinds of OpenTelemetry.
+    enum kind_t { internal = 1, server = 2, client = 3 };
+    
+    uint64_t trace_id[2];
+    uint64_t span_id;
+    uint64_t parent_span_id; // 0 for roots.
+    const char* name;
+    kind_t kind;
+    uint64_t start; // Unix time in nanoseconds.
+    uint64_t end;
+    std::vector<std::pair<const char*, int64_t>> attributes;
+  };
+
+  class span_exporter
+  {
+  public:
+
+    span_exporter():
+      _writer([this](std::stop_token st){ write(st); })
+    {
+    }
+
+    // Never waits for I/O.
+    void push(span_record&& sr){
+      {
+	std::lock_guard l(_mutex);
+
+	if (_queue.size() >= tracing_queue_capacity){
+	  ++_dropped;
+	  return;
+	}
+
+	_queue.push_back(std::move(sr));
+
+	if (_queue.size() < tracing_batch_size){
+	  return;
+	}
+      }
+
+      _cv.notify_one();
+    }
+
+    uint64_t get_dropped() const { return _dropped; }
+    
+  private:
+
+    void write(std::stop_token st){
+      std::ofstream f(tracing_path, std::ios::app);
+
+      for (bool stopping = false; !stopping;){
+	std::vector<span_record> batch;
+
+	{
+	  std::unique_lock l(_mutex);
+	  _cv.wait_for(l, st, std::chrono::seconds(tracing_flush_period), [&]{ return _queue.size() >= tracing_batch_size; });
+	  stopping = st.stop_requested();
+	  size_t n = stopping ? _queue.size() : std::min(_queue.size(), tracing_batch_size);
+	  batch.assign(std::make_move_iterator(_queue.begin()), std::make_move_iterator(_queue.begin() + n));
+	  _queue.erase(_queue.begin(), _queue.begin() + n);
+	}
+
+	if (!batch.empty()){
+	  f << to_otlp_json(batch) << '\n';
+	  f.flush();
+	}
+      }
+    }
+
+    static string hex(uint64_t x){
+      char s[17];
+      snprintf(s, sizeof(s), "%016llx", (unsigned long long) x);
+      return s;
+    }
+    
+    static string to_otlp_json(const std::vector<span_record>& batch){
+      string j = R"({"resourceSpans":[{"resource":{"attributes":[{"key":"service.name","value":{"stringValue":"poi"}}]},"scopeSpans":[{"scope":{"name":"poi"},"spans":[)";
+      
+      for (const span_record& sr: batch){
+	if (&sr != &batch.front()){
+	  j += ',';
+	}
+
+	// Names are literals of the code, they need no escaping.
+	j += R"({"traceId":")" + hex(sr.trace_id[0]) + hex(sr.trace_id[1]) + R"(","spanId":")" + hex(sr.span_id) + '"';
+
+	if (sr.parent_span_id){
+	  j += R"(,"parentSpanId":")" + hex(sr.parent_span_id) + '"';
+	}
+
+	j += R"(,"name":")" + string(sr.name) + R"(","kind":)" + std::to_string(int(sr.kind));
+	j += R"(,"startTimeUnixNano":")" + std::to_string(sr.start) + R"(","endTimeUnixNano":")" + std::to_string(sr.end) + R"(","attributes":[)";
+
+	for (const auto& [key, value]: sr.attributes){
+	  if (&key != &sr.attributes.front().first){
+	    j += ',';
+	  }
+
+	  j += R"({"key":")" + string(key) + R"(","value":{"intValue":")" + std::to_string(value) + R"("}})";
+	}
+
+	j += "]}";
+      }
+
+      return j + "]}]}]}";
+    }
+    
+    std::mutex _mutex;
+    std::condition_variable_any _cv;
+    std::deque<span_record> _queue;
+    std::atomic<uint64_t> _dropped = 0;
+    // Last, so that it stops, writing what is left, before the rest is destroyed.
+    std::jthread _writer;
+  };
+
+  inline span_exporter& get_span_exporter(){
+    static span_exporter se;
+    return se;
+  }
+
+  // A span, from its construction to its destruction. Spans created while another one is open on the same thread are
+  // its children, and are traced if it is. Roots are traced according to the sample rate, unless forced. Spans which
+  // are not traced cost a draw and a few assignments.
+  class span
+  {
+  public:
+
+    explicit span(const char* name, span_record::kind_t kind = span_record::internal, bool forced = false):
+      _parent(current),
+      _traced(_parent ? _parent->_traced : forced || draw() < tracing_sample_rate)
+    {
+      current = this;
+
+      if (!_traced){
+	return;
+      }
+
+      _record.name = name;
+      _record.kind = kind;
+      _record.span_id = random();
+
+      if (_parent){
+	_record.trace_id[0] = _parent->_record.trace_id[0];
+	_record.trace_id[1] = _parent->_record.trace_id[1];
+	_record.parent_span_id = _parent->_record.span_id;
+      }
+      else {
+	_record.trace_id[0] = random();
+	_record.trace_id[1] = random();
+	_record.parent_span_id = 0;
+      }
+      
+      _record.start = now();
+    }
+
+    ~span(){
+      current = _parent;
+
+      if (_traced){
+	_record.end = now();
+	get_span_exporter().push(std::move(_record));
+      }
+    }
+
+    void set_attribute(const char* key, int64_t value){
+      if (_traced){
+	_record.attributes.emplace_back(key, value);
+      }
+    }
+
+  private:
+
+    static uint64_t random(){
+      thread_local std::mt19937_64 g{std::random_device()()};
+      uint64_t r;
+
+      // Ids must not be 0.
+      while (!(r = g()));
+
+      return r;
+    }
+
+    static double draw(){
+      return double(random() >> 11) * 0x1p-53;
+    }
+
+    static uint64_t now(){
+      return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+    
+    inline static thread_local span* current = nullptr;
+    span* _parent;
+    bool _traced;
+    span_record _record;
+  };
+  
+  // Probes.
+
+  inline int64_t probe_coordinate(double c){ return int64_t(c * 1e6); }
+
+  // Fires service__entry and service__return, with the name of the service, around a service call, and traces it.
+  class service_probe
+  {
+  public:
+
+    explicit service_probe(const char* s):
+      _service(s),
+      _span(s, span_record::server)
+    {
+      POI_PROBE(service__entry, _service);
+    }
+
+    ~service_probe(){
+      POI_PROBE(service__return, _service);
+    }
+
+  private:
+
+    const char* _service;
+    span _span;
+  };
+
+  // Also, deletion__detected fires when an index finds out that a poi was deleted, with the index and the two halves of
+  // the poi id.
+
+  // Fires search__start and search__end around an index search, with the index ("kdcache"), the area and category
+  // searched, then the number of hits.
+  inline void probe_search_start([[maybe_unused]] const char* index, [[maybe_unused]] const interval<double>& li, [[maybe_unused]] const interval<double>& Li, [[maybe_unused]] poi::category_t category){
+    POI_PROBE(search__start, index, probe_coordinate(li.get_min()), probe_coordinate(li.get_max()), probe_coordinate(Li.get_min()), probe_coordinate(Li.get_max()), int(category));
+  }
+
+  inline void probe_search_end([[maybe_unused]] const char* index, [[maybe_unused]] size_t hits){
+    POI_PROBE(search__end, index, hits);
+  }
+  
+  // Profiling.
+
+  // Time spent in the phases of service calls, to know what to optimize and to verify that a change moved the expected
+  // phase. Real time and CPU time of the thread are accumulated per phase, for all calls and for the current call.
+  // Parsing the query and serializing the reply are done by Metaspex around the service call, they cannot be measured
+  // here and only show in the totals of the ?t option. Each phase fires phase__enter and phase__exit (phase name), so
+  // that what happens during a phase (allocations, system calls...) can be counted with eBPF, without instrumenting
+  // the back-end.
+  class phase_profile
+  {
+  public:
+
+    enum phase: unsigned { connection, lookup, payload, phases };
+
+    static constexpr const char* names[phases] = {"connection", "lookup", "payload"};
+
+    struct sample
+    {
+      uint64_t real; // Nanoseconds.
+      uint64_t cpu; // Nanoseconds.
+    };
+
+    // Measures a service call on the current thread, from its construction to its destruction.
+    class scope
+    {
+    public:
+
+      scope(phase_profile& pp, phase first):
+	_profile(pp),
+	_phase(first),
+	_start(now()),
+	_previous(current)
+      {
+	current = this;
+	POI_PROBE(phase__enter, names[_phase]);
+      }
+
+      ~scope(){
+	close();
+	current = _previous;
+      }
+
+      void enter(phase p){
+	close();
+	_phase = p;
+	POI_PROBE(phase__enter, names[_phase]);
+      }
+
+      // The number of times a phase was entered during this call, and its time so far.
+      unsigned get_calls(phase p) const { return _calls[p] + (p == _phase); }
+      
+      sample get_total(phase p) const {
+	sample t = _totals[p];
+
+	if (p == _phase){
+	  sample s = now();
+	  t.real += s.real - _start.real;
+	  t.cpu += s.cpu - _start.cpu;
+	}
+
+	return t;
+      }
+      
+    private:
+
+      void close(){
+	sample s = now();
+	sample d{s.real - _start.real, s.cpu - _start.cpu};
+	POI_PROBE(phase__exit, names[_phase]);
+	_profile.add(_phase, d);
+	++_calls[_phase];
+	_totals[_phase].real += d.real;
+	_totals[_phase].cpu += d.cpu;
+	_start = s;
+      }
+      
+      phase_profile& _profile;
+      phase _phase;
+      sample _start;
+      scope* _previous;
+      unsigned _calls[phases] = {};
+      sample _totals[phases] = {};
+    };
+
+    // Ends the current phase of the service call measured on the current thread, if any, and starts another one. For
+    // the functions shared with calls which are not measured.
+    static void enter(phase p){
+      if (current){
+	current->enter(p);
+      }
+    }
+
+    uint64_t get_calls(phase p) const { return _calls[p]; }
+    sample get_total(phase p) const { return sample{_real[p], _cpu[p]}; }
+    
+  private:
+
+    static sample now(){
+      timespec r;
+      timespec c;
+      clock_gettime(CLOCK_MONOTONIC, &r);
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c);
+      return sample{uint64_t(r.tv_sec) * 1000000000 + uint64_t(r.tv_nsec), uint64_t(c.tv_sec) * 1000000000 + uint64_t(c.tv_nsec)};
+    }
+
+    void add(phase p, const sample& s){
+      ++_calls[p];
+      _real[p] += s.real;
+      _cpu[p] += s.cpu;
+    }
+
+    inline static thread_local scope* current = nullptr;
+    std::atomic<uint64_t> _calls[phases] = {};
+    std::atomic<uint64_t> _real[phases] = {};
+    std::atomic<uint64_t> _cpu[phases] = {};
+  };
+
+  inline phase_profile& get_search_profile(){
+    static phase_profile pp;
+    return pp;
+  }
+
+  // Search path, shared by the search service and by the warm-up.
+
+  // We want to display max 100 pois.
+  // We add one so that if we find 101, we return nothing so that the user has to zoom in.
+  constexpr size_t search_limit = 100 + 1;
+
+  // Searches the index for at most limit pois satisfying a predicate. Returns the end of the pois kept, and tells in full
+  // whether the limit was reached. With POI_KDCACHE_EXTENSIONS the predicate is applied during the traversal, and the
+  // pois rejected do not count in the limit. Otherwise the pois are filtered after the search: the pois rejected count,
+  // and the limit can be reached with fewer pois kept.
+  template <typename I, typename P>
+  inline I search_if(
+		     const poi_index& pi,
+		     I b,
+		     size_t limit,
+		     const interval<double>& li,
+		     const interval<double>& Li,
+		     const interval<poi::category_t>& ti,
+		     P&& p,
+		     bool& full
+		     ){
+#ifdef POI_KDCACHE_EXTENSIONS
+    I e = pi.search(b, limit, li, Li, ti, p);
+    full = size_t(e - b) == limit;
+    return e;
+#else
+    I e = pi.search(b, limit, li, Li, ti);
+    full = size_t(e - b) == limit;
+    return std::remove_if(b, e, [&p](const poi_p& q){ return !p(**q); });
+#endif
+  }
+
+  inline ptr<pois_search_data_payload> search_pois(
+						   const poi_index& pi,
+						   const interval<double>& li,
+						   const interval<double>& Li,
+						   poi::category_t category,
+						   time_t open_time = 0
+						   ){
+    // Preparing an array (could be another container such as std::vector or a std::deque) to store the search results.
+    std::array<poi_p, search_limit> a;
+    auto i = a.begin();
+    // The category interval is a singleton.
+    interval<poi::category_t> ti{category};
+    // Searching in the index. When filtering on opening hours, the filter is applied during the traversal if the
+    // kdcache allows it, so that closed pois do not count in the search limit.
+    probe_search_start("kdcache", li, Li, category);
+    auto e = i;
+    bool full = false;
+
+    {
+      span s("kdcache.search");
+      kdcache_timer kt(get_kdcache_metrics().search, &get_kdcache_metrics().search_off_cpu);
+
+      if (open_time){
+	e = search_if(pi, i, search_limit, li, Li, ti,
+		      [slot = weekly_schedule::slot_of(open_time)](const poi& p){ return p.is_open(slot); }, full);
+      }
+      else {
+	e = pi.search(i, search_limit, li, Li, ti);
+	full = size_t(e - i) == search_limit;
+      }
+      
+      s.set_attribute("hits", e - i);
+    }
+    
+    probe_search_end("kdcache", size_t(e - i));
+    phase_profile::enter(phase_profile::payload);
+    
+    // If we got what we asked for (101 pois), we return nothing. This is different from returning an empty list.
+    // It means that the user must zoom in.
+    if (full){
+      return {}; // Please zoom in. Too much to display.
+    }
+    
+    // Now we can get the documents (if any).
+    // Building the empty reply.
+    rfr<pois_search_data_payload> pdp = make<pois_search_data_payload>();
+    
+    // Scanning all the search results.
+    while (i != e){
+      pdp->push_data(make<poi_search_data_payload>(**i));
+      ++i;
+    }
+    
+    return pdp;
+  }
+
+  // Same as above, returning the pois as they were at a given time in the past: the versions in the index which were
+  // already saved, and those in the history which were not removed yet. Opening hours do not apply.
+#ifdef POI_KDCACHE_EXTENSIONS
+  inline ptr<pois_search_data_payload> search_pois_as_of(
+							 const poi_index& pi,
+							 const interval<double>& li,
+							 const interval<double>& Li,
+							 poi::category_t category,
+							 time_t as_of
+							 ){
+    std::array<poi_p, search_limit> a;
+    auto i = a.begin();
+    interval<poi::category_t> ti{category};
+    probe_search_start("kdcache", li, Li, category);
+    auto e = i;
+
+    {
+      span s("kdcache.search");
+      kdcache_timer kt(get_kdcache_metrics().search, &get_kdcache_metrics().search_off_cpu);
+      e = pi.search(i, search_limit, li, Li, ti, [as_of](const poi& p){ return p.get_last_save_timestamp() <= as_of; });
+      s.set_attribute("hits", e - i);
+    }
+    
+    probe_search_end("kdcache", size_t(e - i));
+    phase_profile::enter(phase_profile::payload);
+    rfr<pois_search_data_payload> pdp = make<pois_search_data_payload>();
+    size_t found = size_t(e - i);
+
+    while (i != e){
+      pdp->push_data(make<poi_search_data_payload>(**i));
+      ++i;
+    }
+
+    found += get_poi_index_observer().history.search(li, Li, category, as_of, search_limit - found, [&](const removed_poi& rp){
+      pdp->push_data(make<poi_search_data_payload>(rp));
+    });
+
+    if (found == search_limit){
+      return {}; // Please zoom in. Too much to display.
+    }
+
+    return pdp;
+  }
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Searching only what changes when moving from an area to another one, for instance when panning a map.
+  // Searches each part of the area a outside of b, appending at most limit pois to found. Returns false if there
+  // are more.
+  inline bool search_difference(
+				const poi_index& pi,
+				const rectangle& a,
+				const rectangle& b,
+				poi::category_t category,
+				size_t limit,
+				std::vector<poi_p>& found
+				){
+    interval<poi::category_t> ti{category};
+    size_t size = found.size();
+    found.resize(size + limit + 1);
+    auto e = found.begin() + size;
+    bool overflow = false;
+    
+    for_each_difference(a, b, [&](const rectangle& box, auto&& in_part){
+      size_t remaining = size_t(found.end() - e);
+
+      if (remaining && !overflow){
+	e = search_if(pi, e, remaining, latitudes(box), longitudes(box), ti,
+		      [&](const poi& p){ return in_part(poi::get_latitude(p), poi::get_longitude(p)); }, overflow);
+      }
+    });
+
+    found.erase(e, found.end());
+    return !overflow && found.size() - size <= limit;
+  }
+
+  // Nearest poi per category.
+
+  // Half side of the first square searched around the position, in position units.
+  constexpr double nearest_initial_radius = 16;
+  // Beyond this half side, we give up on the categories which are still missing.
+  constexpr double nearest_maximum_radius = 1 << 20;
+  // Candidates collected by one traversal. If a traversal fills it, the square is too large and is shrunk.
+  constexpr size_t nearest_candidates_limit = 4096;
+
+  inline double distance(double latitude1, double longitude1, double latitude2, double longitude2){
+    return std::hypot(latitude1 - latitude2, longitude1 - longitude2);
+  }
+
+  // One slot per category.
+  struct nearest_pois
+  {
+    std::array<poi_p, poi::categories> pois;
+    std::array<double, poi::categories> distances;
+  };
+
+  // Finds the nearest poi of each of the requested categories (a bit mask indexed by category). Each traversal covers a
+  // square around the position and all the categories not settled yet at once, keeping the best candidate per category.
+  // A candidate at a distance lower than the half side of a completely traversed square is final, its category is
+  // settled and left out of the next traversals, so that a dense category does not fill the candidates of the others.
+  // Once every category has a candidate, the next square is sized on the worst of them, so a single traversal settles
+  // all of them. A caller knowing a bound of the distances (e.g. from a previous nearby search) can give it as the
+  // first radius. The candidates are collected in a buffer given by the caller, so that successive searches reuse it.
+  inline nearest_pois find_nearest(
+				   const poi_index& pi,
+				   double latitude,
+				   double longitude,
+				   std::bitset<poi::categories> requested,
+				   std::vector<poi_p>& candidates,
+				   double radius = nearest_initial_radius
+				   ){
+    nearest_pois n;
+    n.distances.fill(std::numeric_limits<double>::infinity());
+    candidates.resize(std::max(candidates.size(), nearest_candidates_limit));
+    // The requested categories which are not settled yet.
+    std::bitset<poi::categories> pending = requested;
+
+    // Bounding the number of traversals, for extremely dense spots where squares keep being shrunk.
+    for (unsigned traversals = 0; traversals != 64 && pending.any(); ++traversals){
+      size_t lowest = 0;
+      size_t highest = poi::categories - 1;
+
+      while (!pending.test(lowest)){
+	++lowest;
+      }
+
+      while (!pending.test(highest)){
+	--highest;
+      }
+
+      interval<poi::category_t> ti{poi::category_t(lowest), poi::category_t(highest)};
+      auto b = candidates.begin();
+      bool full;
+      auto e = search_if(pi, b, nearest_candidates_limit,
+			 interval<double>{latitude - radius, latitude + radius},
+			 interval<double>{longitude - radius, longitude + radius},
+			 ti,
+			 [&pending](const poi& p){ return pending.test(p.category); },
+			 full);
+
+      for (; b != e; ++b){
+	const poi& p = ***b;
+	double d = distance(latitude, longitude, poi::get_latitude(p), poi::get_longitude(p));
+
+	if (d < n.distances[p.category]){
+	  n.distances[p.category] = d;
+	  n.pois[p.category] = *b;
+	}
+      }
+
+      if (full){
+	// Incomplete, the candidates found are still valid but nothing is final. Shrinking.
+	radius /= 2;
+	continue;
+      }
+
+      // Taking the settled categories out, and looking for the worst remaining one.
+      double worst = 0;
+      
+      for (size_t c = lowest; c <= highest; ++c){
+	if (!pending.test(c)){
+	  continue;
+	}
+	
+	if (n.distances[c] <= radius){
+	  pending.reset(c);
+	}
+	else {
+	  worst = std::max(worst, n.distances[c]);
+	}
+      }
+
+      if (pending.none() || radius >= nearest_maximum_radius){
+	break;
+      }
+
+      // If a category has no candidate yet, worst is infinite and we keep widening.
+      radius = std::min(std::max(worst, radius * 2), nearest_maximum_radius);
+    }
+
+    return n;
+  }
+
+  // Parallel work.
+
+  // A pool of threads sharing the jobs submitted. The tasks of a job are claimed one at a time, so that threads
+  // finishing early take over the remaining tasks of the slower ones. The submitting thread works on its own job too.
+  class worker_pool
+  {
+  public:
+
+    explicit worker_pool(unsigned threads){
+      for (unsigned t = 0; t != threads; ++t){
+	_threads.emplace_back([this](std::stop_token st){ work(st); });
+      }
+    }
+
+    ~worker_pool(){
+      for (std::jthread& t: _threads){
+	t.request_stop();
+      }
+    }
+
+    // Calls f(0) to f(tasks - 1), in parallel, and returns when they are all done.
+    void run(size_t tasks, std::function<void(size_t)> f){
+      auto j = std::make_shared<job>(std::move(f), tasks);
+
+      {
+	std::lock_guard l(_mutex);
+	_jobs.push_back(j);
+      }
+
+      _cv.notify_all();
+      j->work();
+      std::unique_lock l(j->mutex);
+      j->cv.wait(l, [&]{ return j->done == j->tasks; });
+    }
+    
+  private:
+
+    struct job
+    {
+      job(std::function<void(size_t)>&& g, size_t t):
+	f(std::move(g)),
+	tasks(t)
+      {
+      }
+
+      void work(){
+	for (size_t t; (t = next++) < tasks;){
+	  f(t);
+
+	  if (++done == tasks){
+	    std::lock_guard l(mutex);
+	    cv.notify_all();
+	  }
+	}
+      }
+
+      std::function<void(size_t)> f;
+      const size_t tasks;
+      std::atomic<size_t> next = 0;
+      std::atomic<size_t> done = 0;
+      std::mutex mutex;
+      std::condition_variable cv;
+    };
+
+    void work(std::stop_token st){
+      for (;;){
+	std::shared_ptr<job> j;
+
+	{
+	  std::unique_lock l(_mutex);
+
+	  // Jobs whose tasks are all claimed are dropped, the threads working on them will finish them.
+	  bool available = _cv.wait(l, st, [&]{
+	    while (!_jobs.empty() && _jobs.front()->next >= _jobs.front()->tasks){
+	      _jobs.pop_front();
+	    }
+
+	    return !_jobs.empty();
+	  });
+
+	  // Only false when stopping.
+	  if (!available){
+	    return;
+	  }
+
+	  j = _jobs.front();
+	}
+
+	j->work();
+      }
+    }
+    
+    std::mutex _mutex;
+    std::condition_variable_any _cv;
+    std::deque<std::shared_ptr<job>> _jobs;
+    std::vector<std::jthread> _threads;
+  };
+
+  inline worker_pool& get_worker_pool(){
+    static worker_pool wp(std::max(1u, std::thread::hardware_concurrency()));
+    return wp;
+  }
+
+  // Batch assignment of the nearest poi.
+
+  // Number of positions processed by a task. They are consecutive along the curve below.
+  constexpr size_t assignment_task_size = 256;
+  // Where the offline assignment job reads and writes its files. It must be readable and writable by the Web server.
+  constexpr const char* assignment_directory = "/var/tmp/poi_assignments/";
+
+  // Position of (x, y) along a Hilbert curve covering a 2^16 x 2^16 grid. Points close on the curve are close on the
+  // grid.
+  inline uint64_t hilbert_index(uint32_t x, uint32_t y){
+    uint64_t d = 0;
+
+    for (uint32_t s = 1u << 15; s != 0; s >>= 1){
+      uint32_t rx = (x & s) ? 1 : 0;
+      uint32_t ry = (y & s) ? 1 : 0;
+      d += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+      // Rotating the quadrant.
+      if (ry == 0){
+	if (rx == 1){
+	  x = 0xffff - x;
+	  y = 0xffff - y;
+	}
+
+	std::swap(x, y);
+      }
+    }
+
+    return d;
+  }
+
+  struct query_position
+  {
+    double latitude;
+    double longitude;
+  };
+
+  struct assignment
+  {
+    poi_p point; // Null if no poi of the category was found.
+    double distance;
+  };
+
+  // Assigns to each position the nearest poi of a category. Positions are sorted along a Hilbert curve, so that
+  // consecutive searches visit the same parts of the index, which are then hot in the CPU caches. Each search starts
+  // with a square sized on the previous assignment: the nearest poi of a position is no farther than the previous
+  // nearest poi plus the distance between the two positions, so most searches take a single traversal. Runs of
+  // consecutive positions are spread over the worker pool. If given, processed is increased as positions are assigned,
+  // and the positions not assigned yet when a stop is requested are left without poi.
+  inline std::vector<assignment> assign_nearest(
+						const poi_index& pi,
+						const std::vector<query_position>& positions,
+						poi::category_t category,
+						std::stop_token st = {},
+						std::atomic<size_t>* processed = nullptr
+						){
+    std::vector<assignment> assignments(positions.size(), assignment{{}, std::numeric_limits<double>::infinity()});
+
+    if (positions.empty()){
+      return assignments;
+    }
+    
+    double lm = std::numeric_limits<double>::max();
+    double lM = std::numeric_limits<double>::lowest();
+    double Lm = lm;
+    double LM = lM;
+
+    for (const query_position& qp: positions){
+      lm = std::min(lm, qp.latitude);
+      lM = std::max(lM, qp.latitude);
+      Lm = std::min(Lm, qp.longitude);
+      LM = std::max(LM, qp.longitude);
+    }
+
+    // Sorting along the curve over the bounding box of the positions.
+    double ls = lM > lm ? 65535 / (lM - lm) : 0;
+    double Ls = LM > Lm ? 65535 / (LM - Lm) : 0;
+    std::vector<std::pair<uint64_t, size_t>> order(positions.size());
+
+    for (size_t i = 0; i != positions.size(); ++i){
+      order[i] = {hilbert_index(uint32_t((positions[i].latitude - lm) * ls), uint32_t((positions[i].longitude - Lm) * Ls)), i};
+    }
+
+    std::sort(order.begin(), order.end());
+    std::bitset<poi::categories> requested;
+    requested.set(category);
+    
+    get_worker_pool().run((order.size() + assignment_task_size - 1) / assignment_task_size, [&](size_t task){
+      if (st.stop_requested()){
+	return;
+      }
+      
+      size_t b = task * assignment_task_size;
+      size_t e = std::min(b + assignment_task_size, order.size());
+      size_t count = e - b;
+      const query_position* previous = nullptr;
+      double previous_distance = 0;
+      std::vector<poi_p> candidates;
+
+      for (; b != e; ++b){
+	const query_position& qp = positions[order[b].second];
+	double radius = nearest_initial_radius;
+
+	if (previous && previous_distance != std::numeric_limits<double>::infinity()){
+	  radius = std::max(radius, previous_distance + distance(qp.latitude, qp.longitude, previous->latitude, previous->longitude));
+	}
+	
+	nearest_pois n = find_nearest(pi, qp.latitude, qp.longitude, requested, candidates, radius);
+	assignments[order[b].second] = assignment{n.pois[category], n.distances[category]};
+	previous = &qp;
+	previous_distance = n.distances[category];
+      }
+
+      if (processed){
+	*processed += count;
+      }
+    });
+
+    return assignments;
+  }
+
+  // The offline assignment jobs, by input file name. Each runs on its own thread, which reads the input file, spreads
+  // the assignments over the worker pool and writes the output file, while the status tells how far it got. The status
+  // of a job is kept until a new job is started on the same file, or the back-end stops.
+  class assignment_jobs
+  {
+  public:
+
+    enum state_t { running, done, failed };
+
+    struct status
+    {
+      state_t state;
+      size_t processed;
+      size_t positions;
+      string error;
+    };
+
+    // The pool is built first, so that it is destroyed after the jobs are stopped.
+    assignment_jobs(){
+      get_worker_pool();
+    }
+
+    // Returns false if a job is running on the same file.
+    bool start(const poi_index& pi, const string& name, poi::category_t category){
+      std::lock_guard l(_mutex);
+      std::unique_ptr<job>& j = _jobs[name];
+
+      if (j && j->state == running){
+	return false;
+      }
+
+      // Joining the previous job, which is over.
+      j.reset();
+      j = std::make_unique<job>();
+      job* jp = j.get();
+      jp->thread = std::jthread([jp, &pi, path = string(assignment_directory) + name, category](std::stop_token st){
+	jp->run(st, pi, path, category);
+      });
+      return true;
+    }
+
+    // Returns false if no job was started on the file.
+    bool get_status(const string& name, status& s) const {
+      std::lock_guard l(_mutex);
+      auto i = _jobs.find(name);
+
+      if (i == _jobs.end()){
+	return false;
+      }
+
+      const job& j = *i->second;
+      s.state = j.state;
+      s.processed = j.processed;
+      s.positions = j.positions;
+
+      if (s.state == failed){
+	s.error = j.error;
+      }
+
+      return true;
+    }
+
+  private:
+
+    struct job
+    {
+      void run(std::stop_token st, const poi_index& pi, const string& path, poi::category_t category){
+	std::ifstream in(path);
+
+	if (!in){
+	  fail("Cannot read file.");
+	  return;
+	}
+
+	std::vector<query_position> input;
+	query_position qp;
+
+	while (in >> qp.latitude >> qp.longitude){
+	  input.push_back(qp);
+	}
+
+	positions = input.size();
+	std::vector<assignment> assignments = assign_nearest(pi, input, category, st, &processed);
+
+	// Stopping with the back-end, the output would be incomplete.
+	if (st.stop_requested()){
+	  fail("Stopped.");
+	  return;
+	}
+	
+	std::ofstream out(path + ".out", std::ios::trunc);
+	out.precision(17);
+
+	for (const assignment& a: assignments){
+	  if (a.point){
+	    out << a.point->get_id().to_string() << ' ' << a.distance << '\n';
+	  }
+	  else{
+	    out << "-\n";
+	  }
+	}
+
+	if (!out){
+	  fail("Cannot write file.");
+	  return;
+	}
+
+	state = done;
+      }
+
+      // The error is set before the state, which publishes it.
+      void fail(const string& e){
+	error = e;
+	state = failed;
+      }
+      
+      std::atomic<state_t> state = running;
+      std::atomic<size_t> processed = 0;
+      std::atomic<size_t> positions = 0;
+      string error;
+      // Last, so that it is joined before the rest is destroyed.
+      std::jthread thread;
+    };
+
+    mutable std::mutex _mutex;
+    std::map<string, std::unique_ptr<job>> _jobs;
+  };
+
+  inline assignment_jobs& get_assignment_jobs(){
+    static assignment_jobs aj;
+    return aj;
+  }
+
+  // Offline packages. Their layout is built by poi_core.hpp, from the pois of the kdcache.
+
+  // Where packages are written. It must be writable by the Web server.
+  constexpr const char* package_directory = "/var/tmp/poi_packages/";
+  // Maximum number of pois in a leaf of the kdtree of a package.
+  constexpr uint32_t package_leaf_size = 32;
+
+  // Builds the package of the pois of a region and writes it. Returns its size.
+  inline uint64_t write_package(const std::vector<poi_p>& pois, const rectangle& region, const string& path){
+    std::vector<package_poi> pps;
+    pps.reserve(pois.size());
+
+    for (const poi_p& p: pois){
+      const string& name = p->name;
+      pps.push_back(package_poi{poi::get_latitude(**p), poi::get_longitude(**p), uint8_t(poi::get_category(**p)), p->get_id().to_string(), name});
+    }
+    
+    std::vector<char> file = build_package(pps, region, package_leaf_size);
+
+    // Writing in a temporary file and renaming it, so that a package being downloaded is never truncated.
+    string tmp = path + ".tmp";
+    
+    {
+      std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+      f.write(file.data(), std::streamsize(file.size()));
+
+      if (!f){
+	return 0;
+      }
+    }
+
+    if (rename(tmp.c_str(), path.c_str())){
+      return 0;
+    }
+    
+    return file.size();
+  }
+
+  // Warm-up.
+
+  // After a (re)start the index is built but the documents it points to, and the CPU caches, are cold. The first
+  // minutes of traffic then show a poor p99. To avoid that, a sample of recent searches is recorded from live
+  // traffic and persisted periodically in a local file. Right after the index is built, the sample is replayed
+  // through the search path, payload construction included, before any user search is answered.
+
+  // Where the sample is persisted. It must be writable by the Web server.
+  constexpr const char* warm_up_sample_path = "/var/tmp/poi_search.sample";
+  // Maximum number of queries kept in the sample.
+  constexpr size_t warm_up_sample_capacity = 1024;
+  // One search out of this many is recorded, to keep the recording cost negligible.
+  constexpr unsigned warm_up_sampling_period = 16;
+  // Number of seconds between two persistences of the sample.
+  constexpr time_t warm_up_persistence_period = 60;
+
+  // A recorded search, kept as plain values so that it outlives the service call that produced it.
+  struct recorded_search
+  {
+    double lm;
+    double lM;
+    double Lm;
+    double LM;
+    poi::category_t category;
+  };
+
+  class search_sample
+  {
+  public:
+
+    search_sample(){
+      _searches.reserve(warm_up_sample_capacity);
+    }
+
+    // Called on the search hot path. It never blocks: if another thread is recording, this search is skipped.
+    void record(const interval<double>& li, const interval<double>& Li, poi::category_t category){
+      thread_local unsigned count = 0;
+      
+      if (++count % warm_up_sampling_period){
+	return;
+      }
+
+      std::unique_lock l(_mutex, std::try_to_lock);
+      
+      if (!l.owns_lock()){
+	return;
+      }
+
+      recorded_search rs{li.get_min(), li.get_max(), Li.get_min(), Li.get_max(), category};
+
+      // Oldest searches are overwritten once the sample is full.
+      if (_searches.size() < warm_up_sample_capacity){
+	_searches.push_back(rs);
+      }
+      else{
+	_searches[_next] = rs;
+      }
+
+      _next = (_next + 1) % warm_up_sample_capacity;
+      _recorded = true;
+    }
+
+    // Reads the sample persisted by a previous run, if any.
+    static std::vector<recorded_search> load(){
+      std::vector<recorded_search> searches;
+      std::ifstream f(warm_up_sample_path);
+      recorded_search rs;
+      int category;
+      
+      while (f >> rs.lm >> rs.lM >> rs.Lm >> rs.LM >> category){
+	rs.category = poi::category_t(category);
+	searches.push_back(rs);
+      }
+
+      return searches;
+    }
+    
+  private:
+
+    // Persists the sample periodically, and a last time when stopping, if searches were recorded since the previous
+    // time. The file is never written by the search path.
+    void persist_periodically(std::stop_token st){
+      std::mutex m;
+      std::condition_variable_any cv;
+      std::unique_lock l(m);
+
+      for (bool stopping = false; !stopping;){
+	cv.wait_for(l, st, std::chrono::seconds(warm_up_persistence_period), []{ return false; });
+	stopping = st.stop_requested();
+	std::vector<recorded_search> searches;
+
+	{
+	  // Copying so that the file is written without holding the lock.
+	  std::lock_guard sl(_mutex);
+
+	  if (!_recorded){
+	    continue;
+	  }
+
+	  searches = _searches;
+	  _recorded = false;
+	}
+
+	persist(searches);
+      }
+    }
+
+    // Writing in a temporary file and renaming it, so that a crash never leaves a truncated sample behind.
+    static void persist(const std::vector<recorded_search>& searches){
+      string tmp = string(warm_up_sample_path) + ".tmp";
+      
+      {
+	std::ofstream f(tmp, std::ios::trunc);
+	f.precision(17);
+	
+	for (const recorded_search& rs: searches){
+	  f << rs.lm << ' ' << rs.lM << ' ' << rs.Lm << ' ' << rs.LM << ' ' << int(rs.category) << '\n';
+	}
+
+	if (!f){
+	  return;
+	}
+      }
+
+      rename(tmp.c_str(), warm_up_sample_path);
+    }
+
+    std::mutex _mutex;
+    std::vector<recorded_search> _searches;
+    size_t _next = 0;
+    bool _recorded = false;
+    // Last, so that it stops, persisting what is left, before the rest is destroyed.
+    std::jthread _persister{[this](std::stop_token st){ persist_periodically(st); }};
+  };
+
+  inline search_sample& get_search_sample(){
+    static search_sample s;
+    return s;
+  }
+
+  inline void warm_up(poi_index& pi){
+    for (const recorded_search& rs: search_sample::load()){
+      // The replies are discarded, what matters is that the same code and data were touched.
+      search_pois(pi, interval<double>{rs.lm, rs.lM}, interval<double>{rs.Lm, rs.LM}, rs.category);
+    }
+  }
+
+  // Counting.
+
+  // An output iterator which only counts what is written to it.
+  class counting_iterator
+  {
+  public:
+
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    counting_iterator& operator*(){ return *this; }
+    counting_iterator& operator++(){ ++_count; return *this; }
+    counting_iterator operator++(int){ counting_iterator i = *this; ++_count; return i; }
+
+    template <typename T>
+    counting_iterator& operator=(const T&){ return *this; }
+
+    size_t get_count() const { return _count; }
+
+  private:
+
+    size_t _count = 0;
+  };
+
+  // Counts the pois of an area and category in the kdcache, without limit.
+  inline size_t count_pois(const db::connector& c, const rectangle& area, poi::category_t category){
+    interval<poi::category_t> ti{category};
+    return get_poi_index(c).search(counting_iterator(), std::numeric_limits<size_t>::max(), latitudes(area), longitudes(area), ti).get_count();
+  }
+
+  // Peer broadcast.
+
+  // Without it, the other back-ends behind the load balancer see a new poi after their next refresh, and a deleted one
+  // when they detect it. When enabled, creations and deletions are broadcast to the peers, which apply them to their
+  // indices right away: a deleted poi is removed, a created poi is read from the database, once committed, and inserted.
+  // Each back-end starts receiving when its index is built. Delivery is not guaranteed, the refreshes remain the safety
+  // net.
+
+  enum class peer_transport_kind { none, local, multicast };
+  
+  constexpr peer_transport_kind peer_broadcast = peer_transport_kind::none;
+  // Multicast group and port, shared by all the back-ends. The group is in the organization-local scope.
+  constexpr const char* peer_multicast_group = "239.255.80.73";
+  constexpr uint16_t peer_multicast_port = 48073;
+  // Number of routers a broadcast may cross, 1 for the local network.
+  constexpr int peer_multicast_ttl = 1;
+  // Number of milliseconds a receiver waits before checking whether it must stop.
+  constexpr int peer_receive_wait = 1000;
+  // Number of milliseconds before a creation by a peer is applied. The peer broadcasts during its service call, and its
+  // document is only committed at the end of it.
+  constexpr int peer_created_delay = 1000;
+
+  // Sent as is, back-ends are all the same build on the same architecture. The magic rejects stray datagrams.
+  struct peer_event
+  {
+    enum type_t: uint8_t { created, deleted };
+
+    char magic[4];
+    type_t type;
+    uint64_t sender; // To ignore one's own events.
+    poi_id id;
+  };
+
+  constexpr char peer_magic[4] = {'P', 'O', 'I', '3'};
+
+  // How events travel between back-ends.
+  class peer_transport
+  {
+  public:
+
+    virtual ~peer_transport() = default;
+    
+    virtual void send(const peer_event& e) = 0;
+    // Waits a little for an event, returns false if none came.
+    virtual bool receive(peer_event& e) = 0;
+  };
+
+  // A stand-in for tests and development: a bus between the transports of a single process, each playing a back-end.
+  class local_transport: public peer_transport
+  {
+  public:
+
+    local_transport(){
+      std::lock_guard l(bus_mutex());
+      bus().push_back(this);
+    }
+
+    ~local_transport(){
+      std::lock_guard l(bus_mutex());
+      std::erase(bus(), this);
+    }
+
+    void send(const peer_event& e) override {
+      std::lock_guard l(bus_mutex());
+
+      for (local_transport* t: bus()){
+	if (t != this){
+	  std::lock_guard tl(t->_mutex);
+	  t->_events.push_back(e);
+	  t->_cv.notify_one();
+	}
+      }
+    }
+
+    bool receive(peer_event& e) override {
+      std::unique_lock l(_mutex);
+
+      if (!_cv.wait_for(l, std::chrono::milliseconds(peer_receive_wait), [&]{ return !_events.empty(); })){
+	return false;
+      }
+
+      e = _events.front();
+      _events.pop_front();
+      return true;
+    }
+
+  private:
+
+    static std::mutex& bus_mutex(){
+      static std::mutex m;
+      return m;
+    }
+
+    static std::vector<local_transport*>& bus(){
+      static std::vector<local_transport*> b;
+      return b;
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<peer_event> _events;
+  };
+
+  // UDP multicast on the local network. Each back-end joins the group, and receives its own events too.
+  class multicast_transport: public peer_transport
+  {
+  public:
+
+    // Throws if the group cannot be joined, rather than leaving the back-end deaf and mute to its peers.
+    multicast_transport():
+      _socket(socket(AF_INET, SOCK_DGRAM, 0))
+    {
+      if (_socket < 0){
+	throw std::system_error(errno, std::generic_category(), "peer multicast socket");
+      }
+
+      auto fail = [this](int error, const char* what){
+	close(_socket);
+	throw std::system_error(error, std::generic_category(), what);
+      };
+      int one = 1;
+
+      if (setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))){
+	fail(errno, "peer multicast address reuse");
+      }
+      
+      sockaddr_in local{};
+      local.sin_family = AF_INET;
+      local.sin_addr.s_addr = htonl(INADDR_ANY);
+      local.sin_port = htons(peer_multicast_port);
+
+      if (bind(_socket, reinterpret_cast<const sockaddr*>(&local), sizeof(local))){
+	fail(errno, "peer multicast bind");
+      }
+      
+      ip_mreq membership{};
+
+      // Returns 0, without setting errno, if the address is malformed.
+      if (int r = inet_pton(AF_INET, peer_multicast_group, &membership.imr_multiaddr); r != 1){
+	fail(r ? errno : EINVAL, "peer multicast group address");
+      }
+      
+      membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+      if (setsockopt(_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership))){
+	fail(errno, "peer multicast group membership");
+      }
+      
+      int ttl = peer_multicast_ttl;
+
+      if (setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))){
+	fail(errno, "peer multicast time to live");
+      }
+
+      _group.sin_family = AF_INET;
+      _group.sin_addr = membership.imr_multiaddr;
+      _group.sin_port = htons(peer_multicast_port);
+    }
+
+    ~multicast_transport(){
+      close(_socket);
+    }
+
+    void send(const peer_event& e) override {
+      sendto(_socket, &e, sizeof(e), 0, reinterpret_cast<const sockaddr*>(&_group), sizeof(_group));
+    }
+
+    bool receive(peer_event& e) override {
+      pollfd p{_socket, POLLIN, 0};
+
+      if (poll(&p, 1, peer_receive_wait) <= 0){
+	return false;
+      }
+
+      return recv(_socket, &e, sizeof(e), 0) == ssize_t(sizeof(e)) && !std::memcmp(e.magic, peer_magic, sizeof(peer_magic));
+    }
+
+  private:
+
+    int _socket;
+    sockaddr_in _group{};
+  };
+
+#ifdef POI_KDCACHE_EXTENSIONS
+  // Removes a poi from the kdcache, if it is there.
+  inline void remove_entry(poi_index& pi, const poi_id& id){
+    if (poi_p p = get_poi_index_observer().entries.find(id)){
+      kdcache_timer kt(get_kdcache_metrics().remove);
+      explicit_removal er;
+      pi.remove(*p);
+    }
+  }
+
+  // Inserts a poi in the kdcache, if its document exists. A failure to read it leaves the poi to the refresh.
+  inline void insert_entry(poi_index& pi, const poi_id& id){
+    try {
+      db::connector c{"hx2a"};
+
+      if (poi_p p = poi::get(c, doc_id(id.to_string()))){
+	pi.insert(*p);
+      }
+    }
+    catch (const std::exception&){
+    }
+  }
+
+  // Applies the events of the peers to the indices which are built. Applying an event twice, or after the refresh
+  // which brought the same change, is harmless.
+  inline void apply(const peer_event& e){
+    if (poi_index* pi = built_poi_index){
+      if (e.type == peer_event::deleted){
+	remove_entry(*pi, e.id);
+      }
+      else {
+	insert_entry(*pi, e.id);
+      }
+    }
+  }
+
+  // Broadcasts the events of this back-end and applies those of the others.
+  class peer_broadcaster
+  {
+  public:
+
+    explicit peer_broadcaster(std::unique_ptr<peer_transport>&& t):
+      _transport(std::move(t)),
+      _sender(std::random_device()() | uint64_t(std::random_device()()) << 32),
+      _receiver([this](std::stop_token st){
+	// Creations wait for the commit of the peer, in the order received.
+	std::deque<std::pair<std::chrono::steady_clock::time_point, peer_event>> delayed;
+	
+	for (peer_event e; !st.stop_requested();){
+	  if (_transport->receive(e) && e.sender != _sender){
+	    if (e.type == peer_event::created){
+	      delayed.emplace_back(std::chrono::steady_clock::now() + std::chrono::milliseconds(peer_created_delay), e);
+	    }
+	    else {
+	      apply(e);
+	    }
+	  }
+
+	  for (auto now = std::chrono::steady_clock::now(); !delayed.empty() && delayed.front().first <= now; delayed.pop_front()){
+	    apply(delayed.front().second);
+	  }
+	}
+      })
+    {
+    }
+    
+    void publish(peer_event::type_t type, const poi_id& id){
+      peer_event e{};
+      std::memcpy(e.magic, peer_magic, sizeof(e.magic));
+      e.type = type;
+      e.sender = _sender;
+      e.id = id;
+      _transport->send(e);
+    }
+
+  private:
+
+    std::unique_ptr<peer_transport> _transport;
+    const uint64_t _sender;
+    // Last, so that it stops before the rest is destroyed.
+    std::jthread _receiver;
+  };
+
+  // Null when broadcasting is disabled.
+  inline peer_broadcaster* get_peer_broadcaster(){
+    static std::unique_ptr<peer_broadcaster> pb = []() -> std::unique_ptr<peer_broadcaster> {
+      switch (peer_broadcast){
+      case peer_transport_kind::local:
+	return std::make_unique<peer_broadcaster>(std::make_unique<local_transport>());
+      case peer_transport_kind::multicast:
+	return std::make_unique<peer_broadcaster>(std::make_unique<multicast_transport>());
+      default:
+	return {};
+      }
+    }();
+    return pb.get();
+  }
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Service definitions.
+
+  // Creation of a POI.
+  auto _poi_create = service<"poi_create"> // Singleton. // The name of the service as it'll appear at the end of the URI accepted by the server.
+    ([](const rfr<poi_create_payload>& pcp) -> reply_id_p {
+      service_probe sp("poi_create");
+      db::connector c{"hx2a"}; // Connector to the database described in the configuration file under the logical name "hx2a".
+      
+      // A poi constructor takes a non-null position, we must make sure the client did not forget to send one.
+      
+      // Throwing an exception will stop the service and send back a graceful error message to the client, with specifics about
+      // the issue.
+      position_r pcppos = pcp->pos.or_throw<position_is_missing>();
+
+#ifndef POI_KDCACHE_EXTENSIONS
+      // Without removals from the kdcache, expired pois would stay in it.
+      if (pcp->expiry != poi::never){
+	throw not_supported();
+      }
+#endif
+      
+      // Creation of the poi. As we have a connector it'll persist in the "hx2a" database.
+      // We could write the two lines below as a single one. Using two for readability.
+      // The opening hours are optional. Like the position they are owned by the payload, we must copy them.
+      opening_hours_p hours;
+
+      if (opening_hours_p pcphours = pcp->hours){
+	for (const rfr<opening>& o: pcphours->periods){
+	  if (!opening_hours::is_valid(*o)){
+	    throw invalid_opening_hours();
+	  }
+	}
+	
+	hours = pcphours->copy();
+      }
+      
+      poi_r point = [&]{
+	// The document is written at the commit, after the service call. The span covers its creation.
+	span s("db.create", span_record::client);
+	return make<poi>(*c, pcp->name, pcppos->copy(), pcp->category, pcp->expiry, hours);
+      }();
+#ifdef POI_KDCACHE_EXTENSIONS
+      // Subscribers learn about it right away, without waiting for the refresh of the index.
+      get_poi_index_observer().subscriptions.publish(false, *point);
+
+      // Same for the other back-ends, if broadcasting.
+      if (peer_broadcaster* pb = get_peer_broadcaster()){
+	pb->publish(peer_event::created, poi_id(point->get_id().to_string()));
+      }
+#endif // POI_KDCACHE_EXTENSIONS
+      
+      // Returning the document identifier of the newly-created poi to the client.
+      return make<reply_id>(point->get_id());
+      
+      // No commit, it's done automatically by Metaspex at the end of a successful service call (without exception thrown).
+    });
+
+  // Deletion of a poi.
+  auto _poi_delete = service<"poi_delete">
+    ([](const rfr<query_id>& q){
+      service_probe sp("poi_delete");
+      db::connector c{"hx2a"};
+
+      // Retrieving the point of interest. It is a ptr and not a rfr because the document might not exist and get will return null.
+      // There is no removal by document identifier in Metaspex, unpublish is a member function of the document, so the read
+      // cannot be skipped. It also brings the position and category that subscribers and peers need.
+      poi_r point = [&]{
+	span s("db.get", span_record::client);
+	return poi::get(c, q->get_id()).or_throw<document_does_not_exist>();
+      }();
+      
+      // This marks the document for removal, except if a rollback happens before the end of the service. A rollback is automatically
+      // triggered in case of exception. As we return right after, the document will be removed.
+      {
+	span s("db.unpublish", span_record::client);
+	point->unpublish();
+      }
+#ifdef POI_KDCACHE_EXTENSIONS
+      // Subscribers learn about it right away, without waiting for the index to detect it.
+      get_poi_index_observer().subscriptions.publish(true, *point);
+
+      if (peer_broadcaster* pb = get_peer_broadcaster()){
+	pb->publish(peer_event::deleted, poi_id(point->get_id().to_string()));
+      }
+#endif // POI_KDCACHE_EXTENSIONS
+    });
+
+  // Purge of the documents of expired pois. The index already dropped them on time, this is just cleanup, meant to
+  // be called periodically in the background (e.g. by cron). Each call removes a batch, the reply tells how many.
+#ifdef POI_KDCACHE_EXTENSIONS
+  auto _poi_purge = service<"poi_purge">
+    ([]() -> ptr<purge_payload> {
+      service_probe sp("poi_purge");
+      db::connector c{"hx2a"};
+      // Making sure the index, and therefore its expiry, is running.
+      get_poi_index(c);
+      size_t purged = 0;
+
+      for (const doc_id& id: get_poi_index_observer().expiry.take_expired(purge_batch_size)){
+	// It might have been deleted in the meantime, or its expiry extended or cleared.
+	if (poi_p point = poi::get(c, id); point && point->expiry != poi::never && point->expiry <= time(nullptr)){
+	  point->unpublish();
+	  ++purged;
+	}
+      }
+
+      return make<purge_payload>(purged);
+    });
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Searching for the nearest POI of each of the requested categories, in one call.
+  auto _poi_nearest = service<"poi_nearest">
+    ([](const rfr<position_and_categories>& query) -> ptr<pois_nearest_data_payload> {
+      service_probe sp("poi_nearest");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      position_r qpos = query->pos.or_throw<position_is_missing>();
+      std::bitset<poi::categories> requested;
+
+      const std::vector<poi::category_t>& categories = query->categories;
+
+      for (poi::category_t category: categories){
+	if (size_t(category) < poi::categories){
+	  requested.set(category);
+	}
+      }
+
+      if (requested.none()){
+	requested.set();
+      }
+
+      std::vector<poi_p> candidates;
+      nearest_pois n = find_nearest(pi, qpos->get_latitude(), qpos->get_longitude(), requested, candidates);
+      rfr<pois_nearest_data_payload> pdp = make<pois_nearest_data_payload>();
+
+      // Categories for which nothing was found are just absent from the reply.
+      for (size_t category = 0; category != poi::categories; ++category){
+	if (poi_p p = n.pois[category]){
+	  pdp->push_data(make<poi_nearest_data_payload>(*p, n.distances[category]));
+	}
+      }
+      
+      return pdp;
+    });
+
+  // Assigning the nearest POI of a category to each of the positions sent, in one call.
+  auto _poi_nearest_batch = service<"poi_nearest_batch">
+    ([](const rfr<positions_and_category>& query) -> ptr<poi_assignments_payload> {
+      service_probe sp("poi_nearest_batch");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      std::vector<query_position> positions;
+      positions.reserve(query->positions.size());
+
+      for (const position_r& p: query->positions){
+	positions.push_back(query_position{p->get_latitude(), p->get_longitude()});
+      }
+
+      std::vector<assignment> assignments = assign_nearest(pi, positions, query->category);
+      rfr<poi_assignments_payload> pap = make<poi_assignments_payload>();
+
+      // Positions without any poi of the category are absent from the reply.
+      for (size_t i = 0; i != assignments.size(); ++i){
+	if (poi_p p = assignments[i].point){
+	  pap->push_data(make<poi_assignment_payload>(i, p->get_id(), assignments[i].distance));
+	}
+      }
+
+      return pap;
+    });
+
+  // Offline variant, for millions of positions. The input file of the assignment directory contains one position per
+  // line (latitude and longitude separated by a space). The output file, with the same name suffixed with ".out",
+  // contains one line per input line: the identifier of the nearest poi and its distance, or "-" if there is none.
+  // The call returns once the job is started, poi_nearest_file_status tells when it is done.
+  auto _poi_nearest_file = service<"poi_nearest_file">
+    ([](const rfr<assignment_file>& query){
+      service_probe sp("poi_nearest_file");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      const string& name = query->name;
+
+      // Only plain files of the assignment directory.
+      if (name.empty() || name.find('/') != string::npos || name[0] == '.'){
+	throw invalid_file_name();
+      }
+
+      // A missing file is reported right away, other errors by the status.
+      if (!std::ifstream(string(assignment_directory) + name)){
+	throw cannot_read_file();
+      }
+
+      if (!get_assignment_jobs().start(pi, name, query->category)){
+	throw job_is_running();
+      }
+    });
+
+  auto _poi_nearest_file_status = service<"poi_nearest_file_status">
+    ([](const rfr<file_name>& query) -> ptr<assignment_status_payload> {
+      service_probe sp("poi_nearest_file_status");
+      assignment_jobs::status s;
+
+      if (!get_assignment_jobs().get_status(query->name, s)){
+	throw unknown_job();
+      }
+
+      static constexpr const char* states[] = {"running", "done", "failed"};
+      return make<assignment_status_payload>(states[s.state], s.processed, s.positions, s.error);
+    });
+
+#ifdef POI_KDCACHE_EXTENSIONS
+  // Subscribing to the pois added to and removed from an area, in a given category.
+  auto _poi_subscribe = service<"poi_subscribe">
+    ([](const rfr<area_and_category>& query) -> ptr<subscription_payload> {
+      service_probe sp("poi_subscribe");
+      db::connector c{"hx2a"};
+      // Making sure the index, which publishes the events, is running.
+      get_poi_index(c);
+      return make<subscription_payload>(get_poi_index_observer().subscriptions.subscribe(query->get_latitude_interval(),
+											  query->get_longitude_interval(),
+											  query->category));
+    });
+
+  auto _poi_unsubscribe = service<"poi_unsubscribe">
+    ([](const rfr<subscription_payload>& query){
+      service_probe sp("poi_unsubscribe");
+      get_poi_index_observer().subscriptions.unsubscribe(query->subscription);
+    });
+
+  // Long poll: the reply is sent as soon as events are available, or after a while with no events.
+  auto _poi_events = service<"poi_events">
+    ([](const rfr<subscription_payload>& query) -> ptr<poi_events_payload> {
+      service_probe sp("poi_events");
+      std::vector<poi_event> events;
+      bool overflow = false;
+
+      if (!get_poi_index_observer().subscriptions.poll(query->subscription, events, overflow)){
+	throw unknown_subscription();
+      }
+
+      rfr<poi_events_payload> pep = make<poi_events_payload>(overflow);
+
+      for (const poi_event& e: events){
+	pep->push_data(make<poi_event_payload>(e));
+      }
+
+      return pep;
+    });
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Searching only the pois entering and leaving the display when moving from an area to another one. Like the search
+  // above, nothing is returned if more than 100 pois enter or leave, the user must zoom in.
+  auto _poi_search_diff = service<"poi_search_diff">
+    ([](const rfr<viewport_change>& query) -> ptr<viewport_diff_payload> {
+      service_probe sp("poi_search_diff");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      rfr<area> qprevious = query->previous.or_throw<previous_area_is_missing>();
+      rectangle now(query->get_latitude_interval(), query->get_longitude_interval());
+      rectangle before(qprevious->get_latitude_interval(), qprevious->get_longitude_interval());
+      std::vector<poi_p> entering;
+      std::vector<poi_p> leaving;
+
+      if (!search_difference(pi, now, before, query->category, search_limit - 1, entering) ||
+	  !search_difference(pi, before, now, query->category, search_limit - 1, leaving)){
+	return {}; // Please zoom in. Too much to display.
+      }
+
+      rfr<viewport_diff_payload> vdp = make<viewport_diff_payload>();
+
+      for (const poi_p& p: entering){
+	vdp->push_entering(make<poi_search_data_payload>(*p));
+      }
+
+      std::vector<doc_id> leaving_ids;
+      leaving_ids.reserve(leaving.size());
+
+      for (const poi_p& p: leaving){
+	leaving_ids.push_back(p->get_id());
+      }
+
+      vdp->leaving = leaving_ids;
+      return vdp;
+    });
+
+  // Maximum number of pois in a synchronization snapshot. Larger areas must be split by the client.
+  constexpr size_t sync_snapshot_limit = 100000;
+
+  // Delta synchronization of an area, for offline-capable clients. Returns the changes made since the generation given,
+  // or a full snapshot of the area if the change log does not go back that far. Nothing is returned if the snapshot
+  // has more than 100000 pois, the area must be split.
+  // Generations are those of the change log of this back-end: each back-end sees the changes at its own pace, so there
+  // is no generation common to all of them. The load balancer must keep a client on the same back-end (sticky
+  // sessions); a client sent to another back-end, or syncing after a restart, receives a full snapshot.
+#ifdef POI_KDCACHE_EXTENSIONS
+  auto _poi_sync = service<"poi_sync">
+    ([](const rfr<sync_query>& query) -> ptr<poi_sync_payload> {
+      service_probe sp("poi_sync");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      const change_log& cl = get_poi_index_observer().changes;
+      rectangle area(query->get_latitude_interval(), query->get_longitude_interval());
+      std::vector<poi_event> deltas;
+      uint64_t generation = query->since;
+
+      if (cl.since(generation, area, query->category, [&](const poi_event& e){ deltas.push_back(e); })){
+	rfr<poi_sync_payload> psp = make<poi_sync_payload>(generation, false);
+
+	for (const poi_event& e: deltas){
+	  psp->push_data(make<poi_event_payload>(e));
+	}
+
+	return psp;
+      }
+
+      // Snapshot. The generation is taken before searching, changes made meanwhile will be sent again next time.
+      generation = cl.get_generation();
+      std::vector<poi_p> found(sync_snapshot_limit + 1);
+      interval<poi::category_t> ti{query->category};
+      auto e = pi.search(found.begin(), found.size(), latitudes(area), longitudes(area), ti);
+
+      if (e == found.end()){
+	return {}; // Please split the area.
+      }
+
+      rfr<poi_sync_payload> psp = make<poi_sync_payload>(generation, true);
+
+      for (auto i = found.begin(); i != e; ++i){
+	const poi& p = ***i;
+	psp->push_data(make<poi_event_payload>(poi_event{false, p.get_id(), p.name, poi::get_latitude(p), poi::get_longitude(p)}));
+      }
+
+      return psp;
+    });
+#endif // POI_KDCACHE_EXTENSIONS
+
+  // Building the offline package of a region, with the pois of all categories, in the package directory. Packages are
+  // meant to be served as static files.
+  auto _poi_package = service<"poi_package">
+    ([](const rfr<package_query>& query) -> ptr<package_payload> {
+      service_probe sp("poi_package");
+      db::connector c{"hx2a"};
+      poi_index& pi = get_poi_index(c);
+      const string& name = query->name;
+
+      // Only plain files of the package directory.
+      if (name.empty() || name.find('/') != string::npos || name[0] == '.'){
+	throw invalid_file_name();
+      }
+
+      rectangle region(query->get_latitude_interval(), query->get_longitude_interval());
+      std::vector<poi_p> pois;
+      interval<poi::category_t> ti{poi::ev_charging, poi::shopping};
+      pi.search(std::back_inserter(pois), std::numeric_limits<size_t>::max(), latitudes(region), longitudes(region), ti);
+      uint64_t size = write_package(pois, region, string(package_directory) + name);
+
+      if (!size){
+	throw cannot_write_file();
+      }
+
+      return make<package_payload>(pois.size(), size);
+    });
+
+  // Counting the pois of an area and category, without limit, for instance to display densities.
+  auto _poi_count = service<"poi_count">
+    ([](const rfr<area_and_category>& query) -> ptr<count_payload> {
+      service_probe sp("poi_count");
+      db::connector c{"hx2a"};
+      return make<count_payload>(count_pois(c, rectangle(query->get_latitude_interval(), query->get_longitude_interval()), query->category));
+    });
+
+  // Statistics of the indices, for monitoring. Monitoring must not build an index, those which are not built are
+  // reported empty.
+  auto _poi_stats = service<"poi_stats">
+    ([]() -> ptr<index_stats_payload> {
+      service_probe sp("poi_stats");
+      poi_index* pi = built_poi_index;
+#ifdef POI_KDCACHE_EXTENSIONS
+      size_t pois = pi ? pi->size() : 0;
+#else
+      // Without size(), all the pois are counted. It is a traversal of the whole index.
+      size_t pois = pi ? pi->search(counting_iterator(), std::numeric_limits<size_t>::max(),
+				    interval<double>{std::numeric_limits<double>::lowest(), std::numeric_limits<double>::max()},
+				    interval<double>{std::numeric_limits<double>::lowest(), std::numeric_limits<double>::max()},
+				    interval<poi::category_t>{poi::ev_charging, poi::shopping}).get_count() : 0;
+#endif
+      rfr<index_stats_payload> isp = make<index_stats_payload>(pois, get_span_exporter().get_dropped());
+      phase_profile& pp = get_search_profile();
+
+      for (unsigned p = 0; p != phase_profile::phases; ++p){
+	phase_profile::sample s = pp.get_total(phase_profile::phase(p));
+	isp->push_search_phase(make<phase_stats_payload>(phase_profile::names[p], pp.get_calls(phase_profile::phase(p)), s.real, s.cpu));
+      }
+
+      auto push_kdcache = [&](const string& name, const duration_histogram& h){
+	isp->push_kdcache(make<histogram_payload>(name, h.get_count(), h.get_sum(), h.get_buckets()));
+      };
+      kdcache_metrics& km = get_kdcache_metrics();
+      push_kdcache("search", km.search);
+      push_kdcache("search.lock_wait_estimate", km.search_off_cpu);
+      push_kdcache("remove", km.remove);
+      
+      return isp;
+    });
+
+  // Searching for a POI within an area and a given category.
+  auto _poi_search = service<"poi_search">
+    ([](const rfr<area_and_category>& query) -> ptr<pois_search_data_payload> {
+      service_probe sp("poi_search");
+      phase_profile::scope ps(get_search_profile(), phase_profile::connection);
+      db::connector c{"hx2a"};
+      ps.enter(phase_profile::lookup);
+      // Obtaining the intervals from the area payload.
+      // Putting them aside in case we reuse them for erasure.
+      interval<double> li = query->get_latitude_interval();
+      interval<double> Li = query->get_longitude_interval();
+
+      // Feeding the warm-up sample of the next start. Audit searches, in the past, are left out.
+      if (!query->as_of){
+	get_search_sample().record(li, Li, query->category);
+      }
+
+      // Grabbing the index. The first time it will build it, and warm it up.
+      poi_index& pi = get_poi_index(c);
+
+      ptr<pois_search_data_payload> pdp;
+      
+      // Audit searches, in the past. The removed pois are not retained forever.
+      if (query->as_of){
+#ifdef POI_KDCACHE_EXTENSIONS
+	if (query->as_of < time(nullptr) - history_retention){
+	  throw as_of_before_history();
+	}
+	
+	pdp = search_pois_as_of(pi, li, Li, query->category, query->as_of);
+#else
+	throw not_supported();
+#endif
+      }
+      else {
+	pdp = search_pois(pi, li, Li, query->category, query->get_open_time());
+      }
+
+      // The phases of this call, up to now. There is no reply to attach them to when the user must zoom in.
+      if (query->timing && pdp){
+	rfr<search_timing_payload> stp = make<search_timing_payload>();
+
+	for (unsigned p = 0; p != phase_profile::phases; ++p){
+	  phase_profile::sample s = ps.get_total(phase_profile::phase(p));
+	  stp->push_phase(make<phase_stats_payload>(phase_profile::names[p], ps.get_calls(phase_profile::phase(p)), s.real, s.cpu));
+	}
+
+	pdp->set_timing(stp);
       }
       
       // Returning the payload. If nothing was found the JSON reply will contain an empty array of pois.
@@ -0,0 +1,444 @@
+//
+// Copyright Metaspex - 2023
+// mailto:admin@metaspex.com
+//
+
+// The components of the sample which do not depend on Metaspex: geometry, timing wheel, ids and their map, package
+// layout. They are tested on their own, see test/.
+
+#pragma once
+
+#include <time.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace poi {
+
+  // Geometry.
+
+  // A latitude and longitude rectangle, bounds included, as plain values.
+  struct rectangle
+  {
+    rectangle(double lmin, double lmax, double Lmin, double Lmax):
+      lm(lmin),
+      lM(lmax),
+      Lm(Lmin),
+      LM(Lmax)
+    {
+    }
+
+    // From any interval type offering get_min and get_max.
+    template <typename I>
+    rectangle(const I& li, const I& Li):
+      rectangle(li.get_min(), li.get_max(), Li.get_min(), Li.get_max())
+    {
+    }
+    
+    bool contains(double latitude, double longitude) const {
+      return latitude >= lm && latitude <= lM && longitude >= Lm && longitude <= LM;
+    }
+
+    bool intersects(const rectangle& r) const {
+      return lm <= r.lM && r.lm <= lM && Lm <= r.LM && r.Lm <= LM;
+    }
+
+    double lm;
+    double lM;
+    double Lm;
+    double LM;
+  };
+
+  // Calls f(box, in_part) for each of the (at most four) boxes covering the part of a outside of b. Boxes overlap b on
+  // their boundaries, in_part(latitude, longitude) tells whether a position of the box really belongs to its part, so
+  // that a position belongs to exactly one part.
+  template <typename F>
+  void for_each_difference(const rectangle& a, const rectangle& b, F&& f){
+    if (!a.intersects(b)){
+      f(a, [](double, double){ return true; });
+      return;
+    }
+
+    if (a.lm < b.lm){
+      f(rectangle(a.lm, b.lm, a.Lm, a.LM), [&b](double l, double){ return l < b.lm; });
+    }
+
+    if (a.lM > b.lM){
+      f(rectangle(b.lM, a.lM, a.Lm, a.LM), [&b](double l, double){ return l > b.lM; });
+    }
+
+    double ml = std::max(a.lm, b.lm);
+    double mM = std::min(a.lM, b.lM);
+
+    if (a.Lm < b.Lm){
+      f(rectangle(ml, mM, a.Lm, b.Lm), [&b](double l, double L){ return l >= b.lm && l <= b.lM && L < b.Lm; });
+    }
+
+    if (a.LM > b.LM){
+      f(rectangle(ml, mM, b.LM, a.LM), [&b](double l, double L){ return l >= b.lm && l <= b.lM && L > b.LM; });
+    }
+  }
+
+  // Expiry of temporary pois.
+
+  // A hierarchical timing wheel. Each level has 256 slots, the first one ticking every second, the next one every
+  // 256 seconds, and so on. Scheduling and expiring are O(1), entries cascade down one level at a time as their
+  // deadline approaches. That way expired pois leave the index on time without searches checking anything, and
+  // without sweeping the database.
+  template <typename T>
+  class timing_wheel
+  {
+  public:
+
+    explicit timing_wheel(time_t now):
+      _now(now)
+    {
+    }
+
+    // Entries scheduled in the past expire at the next tick.
+    void schedule(time_t when, const T& value){
+      place(entry{when, value});
+    }
+
+    // Moves the wheel forward up to now, calling f on every entry which expired in between.
+    template <typename F>
+    void advance(time_t now, F&& f){
+      while (_now < now){
+	++_now;
+
+	// Cascading the slots of the upper levels whose turn has come, highest first.
+	for (unsigned level = levels - 1; level != 0; --level){
+	  if (_now & ((time_t(1) << (level * level_bits)) - 1)){
+	    continue;
+	  }
+
+	  std::vector<entry> cascaded;
+	  cascaded.swap(_slots[level][slot_of(_now, level)]);
+
+	  for (const entry& e: cascaded){
+	    place(e);
+	  }
+	}
+
+	std::vector<entry> expired;
+	expired.swap(_slots[0][slot_of(_now, 0)]);
+
+	for (const entry& e: expired){
+	  f(e.value);
+	}
+      }
+    }
+    
+  private:
+
+    static constexpr unsigned level_bits = 8;
+    static constexpr unsigned levels = 4;
+    static constexpr time_t slots = time_t(1) << level_bits;
+
+    struct entry
+    {
+      time_t when;
+      T value;
+    };
+
+    static size_t slot_of(time_t t, unsigned level){
+      return size_t((t >> (level * level_bits)) & (slots - 1));
+    }
+
+    void place(entry e){
+      // Past deadlines fire at the next tick. The wheel covers 2^32 seconds, more than a century.
+      e.when = std::clamp(e.when, _now + 1, _now + (time_t(1) << (levels * level_bits)) - 1);
+      time_t delta = e.when - _now;
+      unsigned level = 0;
+
+      while (level != levels - 1 && delta >= (time_t(1) << ((level + 1) * level_bits))){
+	++level;
+      }
+
+      _slots[level][slot_of(e.when, level)].push_back(e);
+    }
+
+    time_t _now;
+    std::array<std::array<std::vector<entry>, slots>, levels> _slots;
+  };
+
+  // Indices by id.
+
+  // Metaspex document ids are 32 hexadecimal digits. Indices by id keep them on 16 bytes.
+  struct poi_id
+  {
+    poi_id() = default;
+
+    // Anything else than 32 hexadecimal digits gives the null id.
+    explicit poi_id(std::string_view s){
+      if (s.size() != 32 ||
+	  std::from_chars(s.data(), s.data() + 16, high, 16).ptr != s.data() + 16 ||
+	  std::from_chars(s.data() + 16, s.data() + 32, low, 16).ptr != s.data() + 32){
+	high = 0;
+	low = 0;
+      }
+    }
+
+    std::string to_string() const {
+      char s[33];
+      snprintf(s, sizeof(s), "%016llx%016llx", (unsigned long long) high, (unsigned long long) low);
+      return s;
+    }
+
+    bool operator==(const poi_id&) const = default;
+
+    struct hash
+    {
+      size_t operator()(const poi_id& i) const {
+	uint64_t h = (i.high ^ std::rotl(i.low, 32)) * 0x9e3779b97f4a7c15;
+	return size_t(h ^ (h >> 32));
+      }
+    };
+    
+    uint64_t high = 0;
+    uint64_t low = 0;
+  };
+
+  // A hash map from poi ids, with open addressing and linear probing. Entries are stored in a single array, without
+  // allocation per entry, and lookups touch consecutive memory. A null value marks a free entry. Removals shift the
+  // following entries back, so that there are no tombstones slowing down lookups.
+  template <typename V>
+  class id_map
+  {
+  public:
+
+    id_map():
+      _entries(initial_capacity)
+    {
+    }
+
+    const V* find(const poi_id& id) const {
+      for (size_t i = home(id); _entries[i].value; i = next(i)){
+	if (_entries[i].id == id){
+	  return &_entries[i].value;
+	}
+      }
+
+      return nullptr;
+    }
+
+    // The value must not be null.
+    void insert_or_assign(const poi_id& id, const V& v){
+      if ((_size + 1) * 4 > _entries.size() * 3){
+	grow();
+      }
+
+      size_t i = home(id);
+
+      for (; _entries[i].value; i = next(i)){
+	if (_entries[i].id == id){
+	  _entries[i].value = v;
+	  return;
+	}
+      }
+
+      _entries[i] = entry{id, v};
+      ++_size;
+    }
+
+    bool erase(const poi_id& id){
+      size_t i = home(id);
+
+      for (; _entries[i].value; i = next(i)){
+	if (_entries[i].id == id){
+	  break;
+	}
+      }
+
+      if (!_entries[i].value){
+	return false;
+      }
+
+      // Moving back the following entries which would not be found any more from their home.
+      for (size_t j = next(i); _entries[j].value; j = next(j)){
+	size_t h = home(_entries[j].id);
+
+	// True if h is not cyclically in (i, j].
+	if (i <= j ? (h <= i || h > j) : (h <= i && h > j)){
+	  _entries[i] = std::move(_entries[j]);
+	  i = j;
+	}
+      }
+
+      _entries[i] = entry{};
+      --_size;
+      return true;
+    }
+
+    size_t size() const { return _size; }
+    
+  private:
+
+    static constexpr size_t initial_capacity = 1024; // A power of 2.
+    
+    struct entry
+    {
+      poi_id id;
+      V value;
+    };
+
+    size_t home(const poi_id& id) const { return poi_id::hash()(id) & (_entries.size() - 1); }
+    size_t next(size_t i) const { return (i + 1) & (_entries.size() - 1); }
+
+    void grow(){
+      std::vector<entry> entries(_entries.size() * 2);
+      std::swap(entries, _entries);
+      _size = 0;
+
+      for (entry& e: entries){
+	if (e.value){
+	  insert_or_assign(e.id, e.value);
+	}
+      }
+    }
+
+    std::vector<entry> _entries;
+    size_t _size = 0;
+  };
+
+  // Offline packages.
+
+  // A package holds the pois of a region for offline use on a device. It is made of a header followed by sections which
+  // are arrays of fixed-size little-endian values, aligned on 8 bytes, at the offsets given by the header. A device can
+  // map the file in memory and search it in place, without parsing or indexing anything.
+  //
+  // The pois are laid out as an implicit kdtree: a range of more than leaf_size pois is split at its middle, on latitude
+  // at even depths and on longitude at odd depths. The poi at the middle holds the split value, the pois before it are
+  // not greater and the pois after it are not lower. The two ranges around it are split in turn, the middle poi stays
+  // where it is. No node is stored.
+  //
+  // Coordinates are quantized on 32 bits over the region, identifiers and names are in a string table where names are
+  // stored once however many pois bear them. A generic compression is not applied, it would prevent mapping the file;
+  // the transport can compress it.
+  struct package_header
+  {
+    char magic[8];         // "POIPKG2".
+    uint32_t count;        // Number of pois.
+    uint32_t leaf_size;
+    double lm;             // Bounds of the region, for dequantization.
+    double lM;
+    double Lm;
+    double LM;
+    uint64_t coordinates;  // count pairs of uint32_t: latitude, longitude. 0 is the lower bound, 2^32 - 1 the upper one.
+    uint64_t categories;   // count uint8_t.
+    uint64_t strings;      // count pairs of uint32_t: offsets of the identifier and of the name in the string table.
+    uint64_t string_table; // NUL-terminated UTF-8 strings.
+    uint64_t size;         // Of the whole file.
+  };
+
+  constexpr char package_magic[8] = "POIPKG2";
+
+  // What a package needs from a poi.
+  struct package_poi
+  {
+    double latitude;
+    double longitude;
+    uint8_t category;
+    std::string id;
+    std::string_view name; // Must outlive the build.
+  };
+
+  inline uint32_t quantize(double v, double lower, double upper){
+    return upper > lower ? uint32_t(std::llround((v - lower) / (upper - lower) * double(UINT32_MAX))) : 0;
+  }
+
+  // A poi as stored in a package.
+  struct package_entry
+  {
+    uint32_t coordinates[2];
+    uint8_t category;
+    uint32_t id;
+    uint32_t name;
+  };
+
+  // Lays the entries out as the implicit kdtree described above.
+  inline void lay_out_kdtree(std::vector<package_entry>::iterator b, std::vector<package_entry>::iterator e, unsigned depth, uint32_t leaf_size){
+    if (size_t(e - b) <= leaf_size){
+      return;
+    }
+
+    auto m = b + (e - b) / 2;
+    unsigned dimension = depth % 2;
+    std::nth_element(b, m, e, [dimension](const package_entry& x, const package_entry& y){ return x.coordinates[dimension] < y.coordinates[dimension]; });
+    lay_out_kdtree(b, m, depth + 1, leaf_size);
+    lay_out_kdtree(m + 1, e, depth + 1, leaf_size);
+  }
+
+  // Builds the package of pois of a region, in memory.
+  inline std::vector<char> build_package(const std::vector<package_poi>& pois, const rectangle& region, uint32_t leaf_size){
+    std::vector<package_entry> entries;
+    entries.reserve(pois.size());
+    std::string string_table;
+    std::unordered_map<std::string_view, uint32_t> names;
+
+    auto intern = [&](std::string_view s){
+      uint32_t offset = uint32_t(string_table.size());
+      string_table.append(s);
+      string_table.push_back('\0');
+      return offset;
+    };
+    
+    for (const package_poi& p: pois){
+      auto [i, inserted] = names.try_emplace(p.name, 0);
+
+      if (inserted){
+	i->second = intern(p.name);
+      }
+
+      entries.push_back(package_entry{
+	  {quantize(p.latitude, region.lm, region.lM), quantize(p.longitude, region.Lm, region.LM)},
+	  p.category,
+	  intern(p.id),
+	  i->second
+	});
+    }
+
+    lay_out_kdtree(entries.begin(), entries.end(), 0, leaf_size);
+    auto aligned = [](uint64_t o){ return (o + 7) & ~uint64_t(7); };
+    package_header h{};
+    std::memcpy(h.magic, package_magic, sizeof(h.magic));
+    h.count = uint32_t(entries.size());
+    h.leaf_size = leaf_size;
+    h.lm = region.lm;
+    h.lM = region.lM;
+    h.Lm = region.Lm;
+    h.LM = region.LM;
+    h.coordinates = aligned(sizeof(h));
+    h.categories = aligned(h.coordinates + entries.size() * 2 * sizeof(uint32_t));
+    h.strings = aligned(h.categories + entries.size());
+    h.string_table = aligned(h.strings + entries.size() * 2 * sizeof(uint32_t));
+    h.size = h.string_table + string_table.size();
+
+    // Serializing the sections in memory, in order, with their padding.
+    std::vector<char> file(h.size, 0);
+    std::memcpy(file.data(), &h, sizeof(h));
+
+    for (size_t i = 0; i != entries.size(); ++i){
+      const package_entry& pe = entries[i];
+      uint32_t s[2] = {pe.id, pe.name};
+      std::memcpy(file.data() + h.coordinates + i * sizeof(pe.coordinates), pe.coordinates, sizeof(pe.coordinates));
+      file[h.categories + i] = char(pe.category);
+      std::memcpy(file.data() + h.strings + i * sizeof(s), s, sizeof(s));
+    }
+
+    std::memcpy(file.data() + h.string_table, string_table.data(), string_table.size());
+
+    return file;
+  }
+
+} // End namespace poi.
@@ -0,0 +1,263 @@
+//
+// Copyright Metaspex - 2023
+// mailto:admin@metaspex.com
+//
+
+// Tests of the components which do not depend on Metaspex. Each test asserts, the program exits normally if they all
+// pass.
+
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <map>
+#include <random>
+#include <set>
+
+#include "poi_core.hpp"
+
+using namespace poi;
+
+namespace {
+
+  // Every position of a grid over a is in exactly one part of a outside of b, or in b.
+  void test_difference(){
+    rectangle a(0, 10, 0, 10);
+
+    for (const rectangle& b: {rectangle(3, 6, 4, 8), rectangle(-5, 5, -5, 5), rectangle(20, 30, 20, 30), rectangle(0, 10, 0, 10)}){
+      for (double l = 0; l <= 10; l += 0.5){
+	for (double L = 0; L <= 10; L += 0.5){
+	  unsigned parts = 0;
+
+	  for_each_difference(a, b, [&](const rectangle& box, auto&& in_part){
+	    if (box.contains(l, L) && in_part(l, L)){
+	      ++parts;
+	    }
+	  });
+
+	  assert(parts == (b.contains(l, L) ? 0 : 1));
+	}
+      }
+    }
+  }
+
+  // Entries fire at their deadline, whatever the level they were scheduled on, and past deadlines at the next tick.
+  void test_timing_wheel(){
+    const time_t start = 1000000;
+    timing_wheel<time_t> w(start);
+    std::vector<time_t> deadlines = {start + 1, start + 255, start + 256, start + 257, start + 65535, start + 65536,
+				     start + 70000, start + 16777216 + 3};
+
+    for (time_t d: deadlines){
+      w.schedule(d, d);
+    }
+
+    // In the past.
+    w.schedule(start - 10, start + 1);
+    std::multiset<time_t> fired;
+
+    for (time_t now = start + 1; now <= start + 16777216 + 3; ++now){
+      w.advance(now, [&](time_t expected){
+	assert(expected == now);
+	fired.insert(expected);
+      });
+    }
+
+    assert(fired.size() == deadlines.size() + 1);
+    assert(fired.count(start + 1) == 2);
+
+    // A single large step fires everything in between.
+    timing_wheel<time_t> j(start);
+    j.schedule(start + 300, 1);
+    j.schedule(start + 100000, 2);
+    size_t n = 0;
+    j.advance(start + 200000, [&](time_t){ ++n; });
+    assert(n == 2);
+  }
+
+  poi_id random_id(std::mt19937_64& g){
+    poi_id id;
+    id.high = g();
+    id.low = g();
+    return id;
+  }
+
+  void test_poi_id(){
+    poi_id id("0123456789abcdefFEDCBA9876543210");
+    assert(id.high == 0x0123456789abcdef);
+    assert(id.low == 0xfedcba9876543210);
+    assert(id.to_string() == "0123456789abcdeffedcba9876543210");
+    assert(poi_id(id.to_string()) == id);
+    assert(poi_id("0123456789abcdef") == poi_id());
+    assert(poi_id("0123456789abcdefFEDCBA987654321g") == poi_id());
+    assert(poi_id("0123456789abcdef-EDCBA9876543210") == poi_id());
+  }
+
+  // Erasures shifting entries back, including across the end of the array, keep every other entry reachable.
+  void test_id_map(){
+    std::mt19937_64 g(42);
+
+    {
+      // Ids whose home is the last entry of the initial array, so that their cluster wraps around.
+      id_map<int> m;
+      std::vector<poi_id> wrapping;
+
+      while (wrapping.size() != 4){
+	poi_id id = random_id(g);
+
+	if ((poi_id::hash()(id) & 1023) == 1023){
+	  wrapping.push_back(id);
+	}
+      }
+
+      for (size_t i = 0; i != wrapping.size(); ++i){
+	m.insert_or_assign(wrapping[i], int(i + 1));
+      }
+
+      assert(m.erase(wrapping[0]));
+      assert(!m.erase(wrapping[0]));
+      assert(!m.find(wrapping[0]));
+
+      for (size_t i = 1; i != wrapping.size(); ++i){
+	assert(m.find(wrapping[i]) && *m.find(wrapping[i]) == int(i + 1));
+      }
+
+      assert(m.size() == wrapping.size() - 1);
+    }
+
+    {
+      // Growing, assigning and erasing half, against a reference.
+      id_map<int> m;
+      std::map<std::pair<uint64_t, uint64_t>, int> reference;
+      std::vector<poi_id> ids;
+
+      for (int i = 1; i != 20000; ++i){
+	poi_id id = random_id(g);
+	ids.push_back(id);
+	m.insert_or_assign(id, i);
+	reference[{id.high, id.low}] = i;
+      }
+
+      m.insert_or_assign(ids[5], -1);
+      reference[{ids[5].high, ids[5].low}] = -1;
+
+      for (size_t i = 0; i < ids.size(); i += 2){
+	assert(m.erase(ids[i]));
+	reference.erase({ids[i].high, ids[i].low});
+      }
+
+      assert(m.size() == reference.size());
+
+      for (const poi_id& id: ids){
+	auto r = reference.find({id.high, id.low});
+	const int* v = m.find(id);
+	assert(r == reference.end() ? !v : v && *v == r->second);
+      }
+    }
+  }
+
+  template <typename T>
+  T read(const std::vector<char>& file, uint64_t offset){
+    T v;
+    std::memcpy(&v, file.data() + offset, sizeof(v));
+    return v;
+  }
+
+  // Checks the implicit kdtree over the entries [b, e) of the coordinates section.
+  void check_kdtree(const std::vector<char>& file, const package_header& h, size_t b, size_t e, unsigned depth){
+    if (e - b <= h.leaf_size){
+      return;
+    }
+
+    size_t m = b + (e - b) / 2;
+    unsigned dimension = depth % 2;
+    auto coordinate = [&](size_t i){ return read<uint32_t>(file, h.coordinates + (2 * i + dimension) * sizeof(uint32_t)); };
+    uint32_t split = coordinate(m);
+
+    for (size_t i = b; i != m; ++i){
+      assert(coordinate(i) <= split);
+    }
+
+    for (size_t i = m + 1; i != e; ++i){
+      assert(coordinate(i) >= split);
+    }
+
+    check_kdtree(file, h, b, m, depth + 1);
+    check_kdtree(file, h, m + 1, e, depth + 1);
+  }
+
+  void test_package(){
+    std::mt19937_64 g(7);
+    std::uniform_real_distribution<double> latitude(10, 20);
+    std::uniform_real_distribution<double> longitude(300, 400);
+    const std::vector<std::string> names = {"Metaspex Museum", "EV Charging", "Pop-up Charger"};
+    std::vector<package_poi> pois;
+
+    for (unsigned i = 0; i != 1000; ++i){
+      char id[33];
+      snprintf(id, sizeof(id), "%032x", i);
+      pois.push_back(package_poi{latitude(g), longitude(g), uint8_t(i % 5), id, names[i % names.size()]});
+    }
+
+    // The bounds of the region.
+    pois.push_back(package_poi{10, 300, 0, std::string(32, 'a'), names[0]});
+    pois.push_back(package_poi{20, 400, 0, std::string(32, 'b'), names[0]});
+    rectangle region(10, 20, 300, 400);
+    std::vector<char> file = build_package(pois, region, 32);
+    package_header h = read<package_header>(file, 0);
+    assert(!std::memcmp(h.magic, package_magic, sizeof(h.magic)));
+    assert(h.count == pois.size());
+    assert(h.leaf_size == 32);
+    assert(h.size == file.size());
+
+    for (uint64_t offset: {h.coordinates, h.categories, h.strings, h.string_table}){
+      assert(offset % 8 == 0 && offset <= h.size);
+    }
+
+    assert(h.coordinates >= sizeof(h) && h.categories >= h.coordinates + h.count * 8 && h.strings >= h.categories + h.count &&
+	   h.string_table >= h.strings + h.count * 8);
+    check_kdtree(file, h, 0, h.count, 0);
+
+    // Names are stored once, every poi is found back with its identifier, name and category.
+    std::map<std::string, std::pair<uint8_t, std::string_view>> expected;
+
+    for (const package_poi& p: pois){
+      expected[p.id] = {p.category, p.name};
+    }
+
+    std::set<uint32_t> name_offsets;
+    bool lower = false;
+    bool upper = false;
+
+    for (uint32_t i = 0; i != h.count; ++i){
+      uint32_t id = read<uint32_t>(file, h.strings + i * 8);
+      uint32_t name = read<uint32_t>(file, h.strings + i * 8 + 4);
+      auto e = expected.find(file.data() + h.string_table + id);
+      assert(e != expected.end());
+      assert(e->second.second == file.data() + h.string_table + name);
+      assert(uint8_t(file[h.categories + i]) == e->second.first);
+      name_offsets.insert(name);
+      uint32_t l = read<uint32_t>(file, h.coordinates + i * 8);
+      uint32_t L = read<uint32_t>(file, h.coordinates + i * 8 + 4);
+      lower |= l == 0 && L == 0;
+      upper |= l == UINT32_MAX && L == UINT32_MAX;
+      expected.erase(e);
+    }
+
+    assert(expected.empty());
+    assert(name_offsets.size() == names.size());
+    assert(lower && upper);
+  }
+
+}
+
+int main(){
+  test_difference();
+  test_timing_wheel();
+  test_poi_id();
+  test_id_map();
+  test_package();
+  printf("components: all tests passed\n");
+  return 0;
+}